@@ -22,6 +22,7 @@
 #include <linux/device.h>
 #include <linux/platform_device.h>
 #include <linux/of.h>
+#include <linux/of_reserved_mem.h>
 #include <linux/types.h>
 #include <linux/list.h>
 #include <linux/slab.h>
@@ -30,17 +31,41 @@
 #include <linux/semaphore.h>
 #include <linux/mutex.h>
 #include <linux/mm.h>
+#include <linux/uaccess.h>
 
 #include <linux/dmaengine.h>
 #include <linux/dma-mapping.h>
 
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/cdev.h>
+#include <linux/kref.h>
 #include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/kfifo.h>
+#include <linux/workqueue.h>
+#include <linux/irq_work.h>
+#include <linux/numa.h>
+#include <linux/llist.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/sched/types.h>
+#include <linux/anon_inodes.h>
+#include <linux/ktime.h>
+#include <linux/sched/signal.h>
+#include <linux/crc32c.h>
+
+#include <linux/ezdma.h>
+
+#include "ezdma_sg.h"
 
 #define EZDMA_DEV_NAME_MAX_CHARS (16)
 
-#define SEM_TAKE_TIMEOUT (5)
+
+/* By default, keep two of the engine's slots free of bulk TX so that a
+ * high-priority packet never waits for more than what's already issued. */
+#define EZDMA_DEFAULT_TX_QUEUE_DEPTH    (8)
+#define EZDMA_DEFAULT_TX_BULK_DEPTH     (6)
 
 enum ezdma_dir {
     EZDMA_DEV_TO_CPU = 1,   // RX
@@ -57,19 +82,121 @@ enum dma_fsm_state {
     DMA_COMPLETING = 3,
 };
 
-// These fields should only be valid during an ongoing read/write call.
+/* Pool buffers are either owned by userspace (and may be mmap'd and touched),
+ * handed to the DMA engine, or held by the driver waiting to be handed to the
+ * engine.  The CPU must keep its hands off the latter two.
+ */
+enum ezdma_buf_owner {
+    EZDMA_BUF_USER = 0,
+    EZDMA_BUF_HW = 1,
+    EZDMA_BUF_FREE = 2,
+    EZDMA_BUF_QUEUED = 3,   // submitted for TX, not yet issued to the engine
+    EZDMA_BUF_CAPTURED = 4, // landed, held back for a triggered capture
+};
+
+enum ezdma_prio {
+    EZDMA_PRIO_HIGH = 0,
+    EZDMA_PRIO_NORMAL = 1,
+    EZDMA_NUM_PRIOS,
+};
+
+struct ezdma_buf {
+    struct ezdma_drvdata *  p_info;
+    unsigned int            idx;
+    unsigned int            cls;        // size class
+    struct page *           page;
+    unsigned int            offset;     // of the buffer within page
+    unsigned int            order;
+    void *                  vaddr;
+    dma_addr_t              map_dma;    // handle of the mapping the buffer lives in
+    size_t                  map_size;   // nonzero if this buffer owns page and mapping
+    dma_addr_t              dma;        // bus address of the buffer itself
+    dma_addr_t              fwd_dma;    // mapping on the forwarding peer's device
+    size_t                  size;
+    size_t                  len;        // length of the last completed transfer
+    enum ezdma_buf_owner    owner;
+    struct list_head        node;       // on its class' free list, a TX queue or tx_issued
+    enum ezdma_prio         prio;       // of the pending TX
+    struct ezdma_buf *      chain_next; // next buffer of the same descriptor
+    dma_async_tx_callback_result done_fn;   // completion handler, see ezdma_buf_done()
+    struct dmaengine_result done_result;    // handed to done_fn by rt_thread
+    struct llist_node       done_node;      // on rt_done
+    bool                    clean;      // synced for the device, untouched since
+    unsigned long           deadline;   // of the pending TX in jiffies, 0 if none
+    u32                     crc;        // of the pending TX's data, see EZDMA_IOC_SET_CRC
+    bool                    crc_valid;
+    struct ezdma_completion held_compl; // its record, while held for a capture
+};
+
+struct ezdma_buf_class {
+    unsigned int        first;      // index of the class' first buffer
+    unsigned int        count;
+    size_t              size;
+    size_t              stride;     // spacing of buffers packed into a page
+    struct list_head    free;
+};
+
+struct ezdma_pool {
+    struct device *         dev;        // device the buffers are mapped for
+    unsigned int            count;      // 0 if no pool is allocated
+    unsigned int            num_classes;
+    bool                    coherent;   // buffers from dma_alloc_coherent(), never synced
+    enum dma_data_direction dir;        // the pages are mapped for, if not coherent
+    struct ezdma_buf_class  classes[EZDMA_POOL_MAX_CLASSES];    // ascending size
+    struct ezdma_buf *      bufs;
+    atomic_t                mmap_count;
+    spinlock_t              lock;       // protects buffer ownership, the free lists and the TX
+                                        // queues, may be taken from interrupt (tasklet) context
+};
+
+/* Token bucket.  Credit is kept in token-microseconds so that frequent refills
+ * at low rates don't round away, and may go negative after a transfer larger
+ * than the bucket is let through.
+ */
+struct ezdma_bucket {
+    u64     rate;       // tokens per second, 0 if unlimited
+    s64     depth;      // in token-microseconds
+    s64     credit;     // in token-microseconds
+    ktime_t last;       // of the last refill
+};
+
+struct ezdma_group;
+
+// one descriptor's worth of a read()/write(), see EZDMA_IOC_SET_RX_CHUNK
+struct ezdma_chunk {
+    struct ezdma_drvdata *  p_info;
+    unsigned int            nents;      // of pages
+    struct scatterlist *    dma_sgl;    // the DMA segments they were mapped to, for syncing
+    unsigned int            dma_nents;
+    size_t                  len;
+    bool                    last;
+    struct dmaengine_result done_result;    // handed to ezdma_chunk_finish() by rt_thread
+    struct llist_node       done_node;      // on rt_chunks
+};
+
+// These fields should only be valid during an ongoing read/write call.  The
+// page array and scatterlist are kept from one call to the next, so that once
+// they're big enough a transfer doesn't allocate anything.
 struct ezdma_inflight_info {
     struct page **  pinned_pages;
     struct sg_table table;
+    unsigned int    capacity;       // pages pinned_pages and table have room for
     unsigned int    num_pages;
-    bool            table_allocated;
+    unsigned int    dma_nents;      // fewer than num_pages if an IOMMU merged them
+    struct scatterlist * segs;      // DMA segments split at chunk boundaries, kept between calls
+    unsigned int    seg_capacity;
+    struct ezdma_chunk * chunks;    // kept between calls too
+    unsigned int    chunk_capacity;
+    unsigned int    num_chunks;
+    unsigned int    chunks_synced;  // RX chunks handed back to the CPU
     bool            pages_pinned;
     bool            dma_mapped;
     bool            dma_started;
 };
 
 struct ezdma_drvdata {
-    struct platform_device *pdev;
+    struct platform_device *pdev;   // only valid while the node is bound
+    struct kref ref;                // held by the node and by each open file
 
     char name[EZDMA_DEV_NAME_MAX_CHARS];
     uint32_t dir;   // ezdma_dir
@@ -78,8 +205,9 @@ struct ezdma_drvdata {
 
     bool        in_use;
     atomic_t    accepting;
+    bool        gone;       // the node was removed, only an open file keeps this around
 
-    spinlock_t state_lock;  // protects state below, may be taken from interrupt (tasklet) context
+    raw_spinlock_t state_lock;  // protects state below, may be taken from interrupt (tasklet) context
     enum dma_fsm_state state;
     struct ezdma_inflight_info inflight;
 
@@ -88,9 +216,117 @@ struct ezdma_drvdata {
     /* dmaengine */
     struct dma_chan *chan;
 
+    /* kernel-allocated buffers, see EZDMA_IOC_POOL_ALLOC */
+    struct ezdma_pool pool;
+    bool                    pool_static;    // allocated at probe, kept until removal
+    struct device *         rmem_dev;       // holds the "memory-region" pools come from
+    struct device *         pool_pinned;    // pool.dev, kept for a removed node's pool until it's unmapped
+
+    /* prepared transfer, see EZDMA_IOC_PREPARE */
+    struct ezdma_buf *      prep_buf;       // NULL if none
+    size_t                  prep_len;
+    struct dma_async_tx_descriptor * prep_desc; // reusable; NULL to prep on every trigger
+
+    /* RX->TX forwarding, see EZDMA_IOC_FORWARD.  Set on both ends. */
+    struct ezdma_drvdata *  fwd_peer;
+    struct file *           fwd_filp;   // reference on the TX end, held by RX
+    atomic_t                fwd_running;
+    atomic_t                fwd_errors;
+
+    /* completion group membership, see EZDMA_IOC_GROUP_CREATE */
+    struct ezdma_group *    group;
+    unsigned int            group_idx;
+
+    /* streaming, see EZDMA_IOC_STREAM_START */
+    bool                    streaming;
+    atomic_t                stream_running;
+    unsigned int            stream_posted;  // descriptors on the engine, protected by pool.lock
+    unsigned int            overrun_policy; // EZDMA_OVERRUN_*
+    bool                    overrun_flag;   // flag the next record, protected by pool.lock
+    atomic_t                overruns;
+
+    /* RX filter, see EZDMA_IOC_SET_FILTER */
+    struct ezdma_filter     filter;         // protected by pool.lock
+    atomic_t                filter_verdicts[EZDMA_FILTER_TRIGGER + 1];  // packets per verdict
+
+    /* triggered capture, see EZDMA_IOC_CAPTURE_ARM.  Protected by pool.lock. */
+    bool                    capture_armed;
+    bool                    capture_trigger;    // trigger on the next packet
+    bool                    capture_triggered;  // collecting what follows the trigger
+    u64                     capture_pre;
+    u64                     capture_post;
+    u64                     capture_held;       // bytes of history before the trigger
+    u64                     capture_collected;  // ... and after it
+    struct list_head        capture_hist;       // held buffers, oldest first
+    atomic_t                captures;
+
+    /* sequence number of the next packet reported to the group, protected by pool.lock */
+    u32                     compl_seq;
+
+    /* report the CRC32C of every buffer reported to the group, see EZDMA_IOC_SET_CRC */
+    bool                    crc;
+
+    /* queued TX, see EZDMA_IOC_SUBMIT.  Protected by pool.lock. */
+    struct list_head        txq[EZDMA_NUM_PRIOS];   // submitted, not yet issued
+    struct list_head        tx_issued;              // issued, in order
+    unsigned int            tx_inflight;            // issued to the engine
+    unsigned int            tx_bulk_inflight;       // ... of which normal priority
+    unsigned int            tx_queue_depth;         // max issued at once
+    unsigned int            tx_bulk_depth;          // max issued at once at normal priority
+    atomic_t                tx_running;
+    bool                    tx_paused;              // nothing is issued while set
+    unsigned long           tx_next_deadline;       // the watchdog's, 0 if not armed
+    struct delayed_work     tx_watchdog;
+
+    /* what becomes of queued TX when the group stops it, see EZDMA_IOC_SET_CLOSE */
+    unsigned int            close_policy;           // EZDMA_CLOSE_*
+    unsigned long           close_timeout;          // in jiffies, 0 to wait forever
+
+    /* transfer timeout of the current open in jiffies, 0 to wait forever */
+    unsigned long           timeout;
+
+    /* device-tree tuning, see ezdma_of_tune() */
+    unsigned int            align;                  // read()/write() sizes must be multiples
+    size_t                  max_packet;             // largest read()/write(), 0 for no limit
+    unsigned long           default_timeout;        // what timeout is reset to on open
+    unsigned int            default_rx_chunk_pages; // ... and rx_chunk_pages
+
+    /* node to allocate buffers on, NUMA_NO_NODE for the DMA device's own */
+    int                     numa_node;
+
+    /* progressive RX, see EZDMA_IOC_SET_RX_CHUNK */
+    unsigned int            rx_chunk_pages;     // 0 to read in one descriptor
+    struct ezdma_rx_status * rx_status;         // page mmapped by userspace, RX only
+
+    /* completion steering, see the steer_completions sysfs attribute */
+    int                     submit_cpu;     // CPU the pending read()/write() was issued from
+    int                     callback_cpu;   // CPU the last completion callback ran on
+    atomic_t                cross_cpu_completions;
+    bool                    steer_completions;
+
+    /* fail read()/write() unless the buffer maps to one DMA segment */
+    bool                    require_contiguous;
+    struct irq_work         wake_work;
+
+    /* threaded completions, see the rt_priority sysfs attribute */
+    unsigned int            rt_priority;    // SCHED_FIFO priority of rt_thread
+    struct task_struct *    rt_thread;      // NULL if completions run in the tasklet
+    struct llist_head       rt_done;        // completed pool buffers for rt_thread
+    struct llist_head       rt_chunks;      // ... read() chunks
+    atomic_t                rt_rw_done;     // ... and the read()/write() transfer
+    struct mutex            rt_lock;        // held while completions are being handled
+
+    /* rate limits of the current open, see EZDMA_IOC_SET_LIMITS */
+    spinlock_t              limits_lock;    // protects limits and the buckets
+    struct ezdma_limits     limits;
+    struct ezdma_bucket     byte_bucket;
+    struct ezdma_bucket     pkt_bucket;
+    atomic64_t              tx_outstanding; // bytes submitted and not yet completed
+    wait_queue_head_t       limits_wq;      // woken as tx_outstanding drops
+
     /* device accounting */
     dev_t           ezdma_devt;
-    struct cdev     ezdma_cdev;
+    struct cdev *   ezdma_cdev;     // not embedded:  open files may outlive this
     struct device * ezdma_dev;
 
     /* Statistics */
@@ -100,7 +336,28 @@ struct ezdma_drvdata {
     struct list_head node;
 };
 
-/* LOCK ORDERING:  if taking both sem and state_lock, must always take sem first */
+/* LOCK ORDERING:  if taking both sem and state_lock, must always take sem first.
+ * When binding or unbinding forwarding, the RX channel's sem is taken before
+ * the TX channel's.  rt_lock is taken after sem.
+ *
+ * state_lock is a raw spinlock so it keeps spinning on PREEMPT_RT; nothing
+ * which might sleep there (allocation, unmapping, wakeups) is done under it. */
+
+#define EZDMA_GROUP_BATCH (32)
+
+struct ezdma_group {
+    unsigned int            count;
+    struct ezdma_drvdata *  members[EZDMA_GROUP_MAX_CHANNELS];
+    struct file *           files[EZDMA_GROUP_MAX_CHANNELS];    // keep members open
+
+    spinlock_t              lock;   // protects ring, may be taken from interrupt (tasklet) context
+    DECLARE_KFIFO_PTR(ring, struct ezdma_completion);
+    unsigned int            dropped;        // records lost to a full ring since one got in
+    wait_queue_head_t       wq;
+
+    struct mutex            batch_lock;     // protects batch
+    struct ezdma_completion batch[EZDMA_GROUP_BATCH];
+};
 
 struct ezdma_pdev_drvdata {
     struct list_head ezdma_list;    // list of ezdma_drvdata instances created in
@@ -111,6 +368,7 @@ struct ezdma_pdev_drvdata {
 #define NUM_DEVICE_NUMBERS_TO_ALLOCATE (8)
 static dev_t base_devno;
 static int devno_in_use[NUM_DEVICE_NUMBERS_TO_ALLOCATE];
+static struct ezdma_drvdata * devno_owner[NUM_DEVICE_NUMBERS_TO_ALLOCATE];  // NULL while not openable
 static struct class *ezdma_class;
 static DEFINE_SEMAPHORE(devno_lock);
 
@@ -143,323 +401,1018 @@ static inline int put_devno(dev_t dev)
 
     BUG_ON( 0 == devno_in_use[ MINOR(dev) ] );
     devno_in_use[ MINOR(dev) ] = 0;
+    devno_owner[ MINOR(dev) ] = NULL;
 
     up( &devno_lock );
     return 0;
 }
 
+// makes the minor open p_info, or nothing if p_info is NULL
+static inline void set_devno_owner(dev_t dev, struct ezdma_drvdata * p_info)
+{
+    down( &devno_lock );
+    devno_owner[ MINOR(dev) ] = p_info;
+    up( &devno_lock );
+}
+
+static void ezdma_drvdata_release( struct kref * ref );
+
+// returns the channel behind the minor with a reference taken, or NULL
+static struct ezdma_drvdata * get_devno_owner(unsigned int minor)
+{
+    struct ezdma_drvdata * p_info = NULL;
+
+    down( &devno_lock );
+
+    if ( minor < NUM_DEVICE_NUMBERS_TO_ALLOCATE && (p_info = devno_owner[minor]) )
+        kref_get( &p_info->ref );
+
+    up( &devno_lock );
+
+    return p_info;
+}
+
 
 
 static int ezdma_open(struct inode *inode, struct file *filp);
 static ssize_t ezdma_read(struct file *filp, char __user *userbuf, size_t count, loff_t *f_pos);
 static ssize_t ezdma_write(struct file *filp, const char __user *userbuf, size_t count, loff_t *f_pos);
 static int ezdma_release(struct inode *inode, struct file *filp);
+static long ezdma_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static int ezdma_mmap(struct file *filp, struct vm_area_struct *vma);
 
 static const struct file_operations ezdma_fops = {
-    .owner      = THIS_MODULE,
-    .open       = ezdma_open,
-    .read       = ezdma_read,
-    .write      = ezdma_write,
-    .release    = ezdma_release,
+    .owner          = THIS_MODULE,
+    .open           = ezdma_open,
+    .read           = ezdma_read,
+    .write          = ezdma_write,
+    .release        = ezdma_release,
+    .unlocked_ioctl = ezdma_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .mmap           = ezdma_mmap,
     //.poll       = ezdma_poll,
 };
 
+static inline enum dma_data_direction ezdma_data_dir( struct ezdma_drvdata * p_info )
+{
+    return p_info->dir == EZDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+}
+
+static inline enum dma_transfer_direction ezdma_xfer_dir( struct ezdma_drvdata * p_info )
+{
+    return p_info->dir == EZDMA_DEV_TO_CPU ? DMA_DEV_TO_MEM : DMA_MEM_TO_DEV;
+}
+
+// the device that actually performs DMA for this channel
+static inline struct device * ezdma_dma_dev( struct ezdma_drvdata * p_info )
+{
+    return p_info->chan->device->dev;
+}
+
+// the NUMA node this channel's buffers are allocated on
+static inline int ezdma_numa_node( struct ezdma_drvdata * p_info )
+{
+    if ( NUMA_NO_NODE != p_info->numa_node )
+        return p_info->numa_node;
+
+    return dev_to_node( ezdma_dma_dev( p_info ) );
+}
+
+/*
+ * Rate limits.
+ *
+ * Transfers are held back before they take the channel's sem, so a throttled
+ * submitter never holds up completions or buffers being recycled.
+ */
+
+static void ezdma_bucket_init( struct ezdma_bucket * b, u64 rate, u64 burst )
+{
+    if ( !burst )
+        burst = max_t( u64, rate / 10, 1 );
+
+    b->rate = rate;
+    b->depth = (s64)burst * USEC_PER_SEC;
+    b->credit = b->depth;
+    b->last = ktime_get();
+}
+
+static void ezdma_bucket_refill( struct ezdma_bucket * b, ktime_t now )
+{
+    // clamped so rate * elapsed can't overflow; a debt this old just takes another round
+    s64 elapsed = min_t( s64, ktime_us_delta( now, b->last ), 1LL << 28 );
+
+    if ( b->rate )
+        b->credit = min_t( s64, b->depth, b->credit + (s64)b->rate * elapsed );
+
+    b->last = now;
+}
+
+// microseconds until cost tokens are available, 0 if they are now
+static u64 ezdma_bucket_wait_us( const struct ezdma_bucket * b, u64 cost )
+{
+    s64 need;
+
+    if ( !b->rate )
+        return 0;
+
+    // anything bigger than the bucket goes once the bucket is full
+    need = min_t( s64, cost * USEC_PER_SEC, b->depth );
+
+    if ( b->credit >= need )
+        return 0;
+
+    return div64_u64( need - b->credit + b->rate - 1, b->rate );
+}
+
+static void ezdma_bucket_charge( struct ezdma_bucket * b, u64 cost )
+{
+    if ( b->rate )
+        b->credit -= cost * USEC_PER_SEC;
+}
+
+static void ezdma_bucket_refund( struct ezdma_bucket * b, u64 cost )
+{
+    if ( b->rate )
+        b->credit = min_t( s64, b->depth, b->credit + cost * USEC_PER_SEC );
+}
+
+// should be called with p_info->sem held
+static void ezdma_limits_reset( struct ezdma_drvdata * p_info )
+{
+    spin_lock( &p_info->limits_lock );
+
+    memset( &p_info->limits, 0, sizeof(p_info->limits) );
+    ezdma_bucket_init( &p_info->byte_bucket, 0, 0 );
+    ezdma_bucket_init( &p_info->pkt_bucket, 0, 0 );
+
+    spin_unlock( &p_info->limits_lock );
+}
+
+static int ezdma_limits_set( struct ezdma_drvdata * p_info, const struct ezdma_limits * limits )
+{
+    if ( limits->bytes_per_sec > EZDMA_LIMIT_MAX_RATE ||
+         limits->burst_bytes > limits->bytes_per_sec ||
+         limits->burst_packets > limits->packets_per_sec )
+        return -EINVAL;
+
+    spin_lock( &p_info->limits_lock );
+
+    p_info->limits = *limits;
+    ezdma_bucket_init( &p_info->byte_bucket, limits->bytes_per_sec, limits->burst_bytes );
+    ezdma_bucket_init( &p_info->pkt_bucket, limits->packets_per_sec, limits->burst_packets );
+
+    spin_unlock( &p_info->limits_lock );
+
+    wake_up( &p_info->limits_wq );  // the quota may have grown
+
+    return 0;
+}
+
+static bool ezdma_quota_ok( struct ezdma_drvdata * p_info, size_t count )
+{
+    u64 outstanding = atomic64_read( &p_info->tx_outstanding );
+    u64 max;
+
+    spin_lock( &p_info->limits_lock );
+    max = p_info->limits.max_outstanding_bytes;
+    spin_unlock( &p_info->limits_lock );
+
+    // a transfer bigger than the quota goes once nothing else is outstanding
+    return !max || !outstanding || outstanding + count <= max;
+}
 
+// Holds back a transfer of count bytes until the limits allow it.  Queued
+// transfers also count against the outstanding-bytes quota.
+static int ezdma_limits_wait( struct ezdma_drvdata * p_info, size_t count, bool queued, bool nonblock )
+{
+    if ( queued && !ezdma_quota_ok( p_info, count ) )
+    {
+        if ( nonblock )
+            return -EAGAIN;
+
+        if ( wait_event_interruptible( p_info->limits_wq, ezdma_quota_ok( p_info, count ) ) )
+            return -ERESTARTSYS;
+    }
+
+    for ( ;; )
+    {
+        ktime_t now = ktime_get();
+        u64 wait_us;
+
+        spin_lock( &p_info->limits_lock );
+
+        ezdma_bucket_refill( &p_info->byte_bucket, now );
+        ezdma_bucket_refill( &p_info->pkt_bucket, now );
+
+        // both buckets have to admit it before either is charged
+        wait_us = max( ezdma_bucket_wait_us( &p_info->byte_bucket, count ),
+                       ezdma_bucket_wait_us( &p_info->pkt_bucket, 1 ) );
+
+        if ( 0 == wait_us )
+        {
+            ezdma_bucket_charge( &p_info->byte_bucket, count );
+            ezdma_bucket_charge( &p_info->pkt_bucket, 1 );
+        }
+
+        spin_unlock( &p_info->limits_lock );
+
+        if ( 0 == wait_us )
+            return 0;
+
+        if ( nonblock )
+            return -EAGAIN;
+
+        schedule_timeout_interruptible( nsecs_to_jiffies( wait_us * NSEC_PER_USEC ) + 1 );
 
+        if ( signal_pending( current ) )
+            return -ERESTARTSYS;
+    }
+}
+
+// Gives back what ezdma_limits_wait() charged for a transfer that didn't go after all.
+static void ezdma_limits_refund( struct ezdma_drvdata * p_info, size_t count )
+{
+    spin_lock( &p_info->limits_lock );
+
+    ezdma_bucket_refund( &p_info->byte_bucket, count );
+    ezdma_bucket_refund( &p_info->pkt_bucket, 1 );
+
+    spin_unlock( &p_info->limits_lock );
+}
 
 static int ezdma_open(struct inode *inode, struct file *filp)
 {
-    struct ezdma_drvdata * p_info = container_of(inode->i_cdev, struct ezdma_drvdata, ezdma_cdev); 
+    struct ezdma_drvdata * p_info = get_devno_owner( iminor(inode) );
     int rv = 0;
 
+    if ( !p_info )
+        return -ENODEV;     // its node is being removed
+
     if ( down_interruptible( &p_info->sem ) )
+    {
+        kref_put( &p_info->ref, ezdma_drvdata_release );
         return -ERESTARTSYS;
+    }
 
-    if ( p_info->in_use )
+    if ( p_info->gone )
+    {
+        rv = -ENODEV;
+    }
+    else if ( p_info->in_use )
     {
         rv = -EBUSY;
     }
     else
     {
         p_info->in_use = 1;
-        filp->private_data = p_info;
+        filp->private_data = p_info;    // the file keeps the reference
         atomic_set( &p_info->accepting, 1 );
+        ezdma_limits_reset( p_info );
+        p_info->timeout = p_info->default_timeout;
+        p_info->numa_node = NUMA_NO_NODE;
+        p_info->rx_chunk_pages = p_info->default_rx_chunk_pages;
+        p_info->overrun_policy = EZDMA_OVERRUN_STALL;
+        p_info->compl_seq = 0;
+        p_info->filter.num_rules = 0;
+        p_info->crc = false;
+        p_info->close_policy = EZDMA_CLOSE_ABORT;
+        p_info->capture_armed = false;
     }
     
     up( &p_info->sem );
 
+    if ( rv )
+        kref_put( &p_info->ref, ezdma_drvdata_release );
+
     return rv;
 }
 
 // this runs in tasklet (interrupt) context -- no sleeping!
-static void ezdma_dmaengine_callback_func(void *data)
+// runs on the CPU the transfer was issued from, see steer_completions
+static void ezdma_steered_wake( struct irq_work * work )
 {
-    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)data;
-    unsigned long iflags;
+    struct ezdma_drvdata * p_info = container_of( work, struct ezdma_drvdata, wake_work );
 
-    //printk( KERN_ERR KBUILD_MODNAME ": %s: callback fired for %s\n",
-    //        p_info->name, p_info->dir == EZDMA_DEV_TO_CPU ? "RX" : "TX" );
+    wake_up_interruptible( &p_info->wq );
+}
+
+// finishes a read()/write() transfer, from the tasklet or rt_thread
+static void ezdma_rw_complete( struct ezdma_drvdata * p_info )
+{
+    unsigned long iflags;
+    bool wake = false;
+    int steer_cpu = -1;
 
-    spin_lock_irqsave(&p_info->state_lock, iflags);
+    raw_spin_lock_irqsave(&p_info->state_lock, iflags);
 
     if ( DMA_IN_FLIGHT == p_info->state )
     {
+        const int cpu = smp_processor_id();
+        const int submit_cpu = p_info->submit_cpu;
+
         p_info->state = DMA_COMPLETING;
-        wake_up_interruptible( &p_info->wq );
+        WRITE_ONCE( p_info->callback_cpu, cpu );
+
+        if ( cpu != submit_cpu )
+            atomic_inc( &p_info->cross_cpu_completions );
+
+        // wake the waiter from its own CPU, so its wakeup stays local
+        if ( cpu != submit_cpu && READ_ONCE( p_info->steer_completions ) && cpu_online( submit_cpu ) )
+            steer_cpu = submit_cpu;
+        else
+            wake = true;
     }
     // else: well, nevermind then...
     
-    spin_unlock_irqrestore(&p_info->state_lock, iflags);
-}
+    raw_spin_unlock_irqrestore(&p_info->state_lock, iflags);
 
+    if ( steer_cpu >= 0 )
+        irq_work_queue_on( &p_info->wake_work, steer_cpu );
+    else if ( wake )
+        wake_up_interruptible( &p_info->wq );
+}
 
-/* 
- * DMA procedure:
- * 
- * Figure out how many pages.
- * Allocate page array and scatterlist.
- * Try to pin pages using get_user_pages_fast().
- * Map the pages for DMA.
- * Issue DMA request.
- * Wait on condition variable.
- * if interrupted, terminate_all DMAs
- * Unmap DMA
- * SetPageDirty()   // if RX, assume all pages were written
- * free page array and scatterlist
- */
-static void ezdma_unprepare_after_dma( struct ezdma_drvdata * p_info );
-
-// should be called with p_info->sem held, but not p_info->state_lock
-static int ezdma_prepare_for_dma(
-        struct ezdma_drvdata * p_info, 
-        char __user *userbuf,
-        size_t count
-)
+static void ezdma_dmaengine_callback_func(void *data)
 {
-    int rv;
-
-    BUG_ON( p_info->inflight.pinned_pages ); // should be NULL
-    memset( &p_info->inflight, 0, sizeof( struct ezdma_inflight_info ) );
-    
-    p_info->inflight.num_pages = (offset_in_page(userbuf) + count + PAGE_SIZE-1) / PAGE_SIZE;
-    p_info->inflight.pinned_pages = kmalloc( 
-        p_info->inflight.num_pages * sizeof(struct page*),
-        GFP_KERNEL);
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)data;
+    struct task_struct * const thread = READ_ONCE( p_info->rt_thread );
 
-    if ( !p_info->inflight.pinned_pages )
-    {
-        rv = -ENOMEM;
-        goto err_out;
-    }
+    //printk( KERN_ERR KBUILD_MODNAME ": %s: callback fired for %s\n",
+    //        p_info->name, p_info->dir == EZDMA_DEV_TO_CPU ? "RX" : "TX" );
 
-    if ( (rv = sg_alloc_table(
-                    &p_info->inflight.table, 
-                    p_info->inflight.num_pages,
-                    GFP_KERNEL )) )
+    if ( thread )
     {
-        printk( KERN_ERR KBUILD_MODNAME ": %s: sg_alloc_table() returned %d\n", 
-                p_info->name, rv);
-        goto err_out;
+        atomic_set( &p_info->rt_rw_done, 1 );
+        wake_up_process( thread );
     }
     else
     {
-        p_info->inflight.table_allocated = 1;
+        ezdma_rw_complete( p_info );
     }
+}
 
-    rv = get_user_pages_fast(
-            (unsigned long)userbuf,             // start
-            p_info->inflight.num_pages,
-            p_info->dir == EZDMA_DEV_TO_CPU,    // write
-            p_info->inflight.pinned_pages);
+/*
+ * Threaded completions.
+ *
+ * With an rt_priority set, completion callbacks only queue their buffer and
+ * wake the channel's rt_thread, which runs the real handlers at a known
+ * SCHED_FIFO priority instead of whenever the tasklet gets to run.
+ */
 
-    if ( rv != p_info->inflight.num_pages )
-    {
-        printk( KERN_ERR KBUILD_MODNAME ": %s: get_user_pages_fast() returned %d, expected %d\n",
-                p_info->name, rv, p_info->inflight.num_pages);
-        goto err_out;
-    }
-    else
-    {
-        p_info->inflight.pages_pinned = 1;
-    }
+static void ezdma_chunk_finish( struct ezdma_chunk * chunk, const struct dmaengine_result * result );
 
-    // Build scatterlist.
-    {
-        int i;
-        struct scatterlist * sg;
-        struct scatterlist * const sgl = p_info->inflight.table.sgl;
-        const unsigned int num_pages = p_info->inflight.num_pages;
+// should be called with p_info->rt_lock held
+static void ezdma_rt_run( struct ezdma_drvdata * p_info )
+{
+    struct llist_node * const chunks = llist_reverse_order( llist_del_all( &p_info->rt_chunks ) );
+    struct llist_node * const done = llist_reverse_order( llist_del_all( &p_info->rt_done ) );
+    struct ezdma_chunk * chunk;
+    struct ezdma_chunk * ctmp;
+    struct ezdma_buf * buf;
+    struct ezdma_buf * tmp;
+
+    // in order, so the last one completes the read() after the others are synced
+    llist_for_each_entry_safe( chunk, ctmp, chunks, done_node )
+        ezdma_chunk_finish( chunk, &chunk->done_result );
+
+    if ( atomic_xchg( &p_info->rt_rw_done, 0 ) )
+        ezdma_rw_complete( p_info );
+
+    // a handler may post its buffer again, and so requeue done_node
+    llist_for_each_entry_safe( buf, tmp, done, done_node )
+        buf->done_fn( buf, &buf->done_result );
+}
 
-        size_t left_to_map = count;
+static int ezdma_rt_thread_fn( void * data )
+{
+    struct ezdma_drvdata * const p_info = (struct ezdma_drvdata*)data;
 
-        for_each_sg( sgl, sg, num_pages, i )
-        {
-            unsigned int len;
-            unsigned int offset;
+    for ( ;; )
+    {
+        set_current_state( TASK_INTERRUPTIBLE );
 
-            len = left_to_map > PAGE_SIZE ? PAGE_SIZE : left_to_map;
+        if ( kthread_should_stop() )
+            break;
 
-            if ( 0 == i )
-            {
-                offset = offset_in_page(userbuf);
-                if ( (offset + len) > PAGE_SIZE )
-                    len = PAGE_SIZE - offset;
-            }
-            else
-            {
-                offset = 0;
-            }
+        if ( llist_empty( &p_info->rt_done ) && llist_empty( &p_info->rt_chunks ) &&
+             !atomic_read( &p_info->rt_rw_done ) )
+        {
+            schedule();
+            continue;
+        }
 
-            //printk( KERN_DEBUG KBUILD_MODNAME ": %s: sgl[%d]: page: %p, len: %d, offset: %d\n",
-            //        p_info->name, i, p_info->inflight.pinned_pages[i], len, offset );
+        __set_current_state( TASK_RUNNING );
 
-            //sg_set_page( sgl, p_info->inflight.pinned_pages[i], len, offset );
-            sg_set_page( sg, p_info->inflight.pinned_pages[i], len, offset );
-            left_to_map -= len;
-        }
+        mutex_lock( &p_info->rt_lock );
+        ezdma_rt_run( p_info );
+        mutex_unlock( &p_info->rt_lock );
     }
 
-    // Map the scatterlist 
+    __set_current_state( TASK_RUNNING );
 
-    rv = dma_map_sg(p_info->ezdma_dev,
-                p_info->inflight.table.sgl,
-                p_info->inflight.num_pages,
-                p_info->dir == EZDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+    return 0;
+}
 
-    if ( rv != p_info->inflight.num_pages )
-    {
-        printk( KERN_ERR KBUILD_MODNAME ": %s: dma_map_sg() returned %d, expected %d\n", 
-                p_info->name, rv, p_info->inflight.num_pages);
-        goto err_out;
-    }
-    else
+// Completion callback of every pool buffer descriptor.
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_buf_done( void * data, const struct dmaengine_result * result )
+{
+    struct ezdma_buf * const buf = (struct ezdma_buf*)data;
+    struct task_struct * const thread = READ_ONCE( buf->p_info->rt_thread );
+
+    if ( !thread )
     {
-        p_info->inflight.dma_mapped = 1;
+        buf->done_fn( buf, result );
+        return;
     }
 
-    // Issue DMA request here
-    {
-        struct dma_async_tx_descriptor * txn_desc;
-        struct scatterlist * const sgl = p_info->inflight.table.sgl;
-        dma_cookie_t cookie;
+    buf->done_result = *result;
+    llist_add( &buf->done_node, &buf->p_info->rt_done );
+    wake_up_process( thread );
+}
 
-        txn_desc = dmaengine_prep_slave_sg(
-                p_info->chan,
-                sgl,
-                p_info->inflight.num_pages,
-                p_info->dir == EZDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE,
-                DMA_PREP_INTERRUPT);    // run callback after this one
+static inline void ezdma_set_callback(
+        struct dma_async_tx_descriptor * txn_desc,
+        struct ezdma_buf * buf,
+        dma_async_tx_callback_result fn
+)
+{
+    buf->done_fn = fn;
+    txn_desc->callback_result = ezdma_buf_done;
+    txn_desc->callback_param = buf;
+}
 
-        if ( !txn_desc )
-        {
-            printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_prep_slave_sg() failed\n", p_info->name);
-            rv = -ENOMEM;
-            goto err_out;
-        }
+// Waits out completions rt_thread was handed before the channel was terminated.
+// should be called with p_info->sem held
+static void ezdma_rt_flush( struct ezdma_drvdata * p_info )
+{
+    if ( !p_info->rt_thread )
+        return;
 
-        txn_desc->callback = ezdma_dmaengine_callback_func;
-        txn_desc->callback_param = p_info;
+    mutex_lock( &p_info->rt_lock );
+    ezdma_rt_run( p_info );
+    mutex_unlock( &p_info->rt_lock );
+}
 
-        spin_lock_irq( &p_info->state_lock );
+// should be called with p_info->sem held, and the channel closed
+static int ezdma_rt_start( struct ezdma_drvdata * p_info, unsigned int priority )
+{
+    const struct sched_attr attr = {
+        .sched_policy   = SCHED_FIFO,
+        .sched_priority = priority,
+    };
+    struct task_struct * thread;
+    int rv;
 
-        p_info->state = DMA_IN_FLIGHT;
+    thread = kthread_create_on_node( ezdma_rt_thread_fn, p_info,
+            p_info->chan ? ezdma_numa_node( p_info ) : NUMA_NO_NODE,
+            "ezdma/%s", p_info->name );
 
-        cookie = dmaengine_submit(txn_desc);
+    if ( IS_ERR( thread ) )
+        return PTR_ERR( thread );
 
-        if ( cookie < DMA_MIN_COOKIE )
-        {
-            printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_submit() returned %d\n", p_info->name, cookie);
-            rv = cookie;
-            p_info->state = DMA_IDLE;
-        }
-        else
-        {
-            p_info->inflight.dma_started = 1;
-            dma_async_issue_pending( p_info->chan );    // Bam!
-            //printk( KERN_ERR KBUILD_MODNAME ": %s: issued pending for %s\n",
-            //        p_info->name,
-            //        p_info->dir == EZDMA_DEV_TO_CPU ? "RX" : "TX" );
-        }
+    if ( (rv = sched_setattr_nocheck( thread, &attr )) )
+    {
+        kthread_stop( thread );     // never woken, so it never runs its function
+        return rv;
+    }
 
-        spin_unlock_irq( &p_info->state_lock );
+    p_info->rt_priority = priority;
+    WRITE_ONCE( p_info->rt_thread, thread );
 
-        if ( cookie < DMA_MIN_COOKIE )
-            goto err_out;
-    }
+    wake_up_process( thread );
 
     return 0;
+}
+
+// should be called with p_info->sem held, and the channel closed
+static void ezdma_rt_stop( struct ezdma_drvdata * p_info )
+{
+    if ( !p_info->rt_thread )
+        return;
+
+    kthread_stop( p_info->rt_thread );
+
+    WRITE_ONCE( p_info->rt_thread, NULL );
+    p_info->rt_priority = 0;
+}
+
+// Cancels everything on the channel, and waits for its callbacks to be done.
+// should be called with p_info->sem held
+static void ezdma_terminate( struct ezdma_drvdata * p_info )
+{
+    if ( p_info->chan )     // else its node was removed, which terminated it
+        dmaengine_terminate_sync( p_info->chan );
+    ezdma_rt_flush( p_info );
+}
+
+/*
+ * Progressive RX.
+ *
+ * The status page is updated seqcount-style:  seq is odd while the other
+ * fields are being written, so a reader can tell it saw a torn update.
+ */
+
+// should be called with p_info->sem held, nothing in flight
+static void ezdma_status_begin( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_rx_status * const status = p_info->rx_status;
+
+    WRITE_ONCE( status->seq, status->seq + 1 );
+    smp_wmb();
+    status->reads++;
+    status->landed = 0;
+    smp_wmb();
+    WRITE_ONCE( status->seq, status->seq + 1 );
+}
+
+// this runs in the tasklet or rt_thread -- no sleeping!
+static void ezdma_status_landed( struct ezdma_drvdata * p_info, size_t len )
+{
+    struct ezdma_rx_status * const status = p_info->rx_status;
+
+    WRITE_ONCE( status->seq, status->seq + 1 );
+    smp_wmb();
+    status->landed += len;
+    smp_wmb();
+    WRITE_ONCE( status->seq, status->seq + 1 );
+}
+
+/* The chunk is only part of what was mapped, which dma_sync_sg_for_cpu()
+ * can't be given, so its DMA segments are synced one by one instead. */
+static void ezdma_chunk_sync_for_cpu( struct ezdma_chunk * chunk )
+{
+    struct device * const dev = ezdma_dma_dev( chunk->p_info );
+    struct scatterlist * sg;
+    unsigned int i;
+
+    for_each_sg( chunk->dma_sgl, sg, chunk->dma_nents, i )
+        dma_sync_single_for_cpu( dev, sg_dma_address( sg ), sg_dma_len( sg ), DMA_FROM_DEVICE );
+}
+
+// this runs in the tasklet or rt_thread -- no sleeping!
+static void ezdma_chunk_finish( struct ezdma_chunk * chunk, const struct dmaengine_result * result )
+{
+    struct ezdma_drvdata * const p_info = chunk->p_info;
+
+    if ( EZDMA_DEV_TO_CPU == p_info->dir && DMA_TRANS_NOERROR == result->result )
+    {
+        // hand this part back to the CPU now, so it can be read while the rest lands
+        ezdma_chunk_sync_for_cpu( chunk );
+        p_info->inflight.chunks_synced++;
+
+        ezdma_status_landed( p_info, chunk->len - min_t( size_t, result->residue, chunk->len ) );
+    }
+
+    if ( chunk->last )
+        ezdma_rw_complete( p_info );
+}
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_chunk_done( void * data, const struct dmaengine_result * result )
+{
+    struct ezdma_chunk * const chunk = (struct ezdma_chunk*)data;
+    struct task_struct * const thread = READ_ONCE( chunk->p_info->rt_thread );
+
+    if ( !thread )
+    {
+        ezdma_chunk_finish( chunk, result );
+        return;
+    }
+
+    // the syncing, too, is left to rt_thread
+    chunk->done_result = *result;
+    llist_add( &chunk->done_node, &chunk->p_info->rt_chunks );
+    wake_up_process( thread );
+}
+
+// should be called with p_info->sem held
+static int ezdma_mmap_status( struct ezdma_drvdata * p_info, struct vm_area_struct * vma )
+{
+    if ( !p_info->rx_status || vma->vm_end - vma->vm_start > PAGE_SIZE || (vma->vm_flags & VM_WRITE) )
+        return -EINVAL;
+
+    vma->vm_flags &= ~VM_MAYWRITE;  // read-only, for good
+
+    return remap_pfn_range( vma, vma->vm_start, page_to_pfn( virt_to_page( p_info->rx_status ) ),
+            PAGE_SIZE, vma->vm_page_prot );
+}
+
+
+/* 
+ * DMA procedure:
+ * 
+ * Figure out how many pages.
+ * Allocate page array and scatterlist.
+ * Try to pin pages using get_user_pages_fast().
+ * Map the pages for DMA.
+ * Issue DMA request.
+ * Wait on condition variable.
+ * if interrupted, terminate_all DMAs
+ * Unmap DMA
+ * SetPageDirty()   // if RX, assume all pages were written
+ * free page array and scatterlist
+ */
+static void ezdma_unprepare_after_dma( struct ezdma_drvdata * p_info );
+static int ezdma_inflight_grow( struct ezdma_drvdata * p_info, unsigned int num_pages );
+static int ezdma_inflight_grow_chunks( struct ezdma_drvdata * p_info, unsigned int num_chunks );
+static int ezdma_inflight_grow_segs( struct ezdma_drvdata * p_info, unsigned int num_segs );
+
+// should be called with p_info->sem held, but not p_info->state_lock
+static int ezdma_prepare_for_dma(
+        struct ezdma_drvdata * p_info, 
+        char __user *userbuf,
+        size_t count
+)
+{
+    int rv;
+
+    p_info->inflight.pages_pinned = 0;
+    p_info->inflight.dma_mapped = 0;
+    p_info->inflight.dma_started = 0;
+    
+    p_info->inflight.num_pages = (offset_in_page(userbuf) + count + PAGE_SIZE-1) / PAGE_SIZE;
+
+    if ( p_info->inflight.num_pages > p_info->inflight.capacity &&
+         (rv = ezdma_inflight_grow( p_info, p_info->inflight.num_pages )) )
+        goto err_out;
+
+    rv = get_user_pages_fast(
+            (unsigned long)userbuf,             // start
+            p_info->inflight.num_pages,
+            p_info->dir == EZDMA_DEV_TO_CPU,    // write
+            p_info->inflight.pinned_pages);
+
+    if ( rv != p_info->inflight.num_pages )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: get_user_pages_fast() returned %d, expected %d\n",
+                p_info->name, rv, p_info->inflight.num_pages);
+
+        // a short pin isn't an error code, and leaves what it did pin to us
+        if ( rv >= 0 )
+        {
+            while ( rv > 0 )
+                put_page( p_info->inflight.pinned_pages[ --rv ] );
+
+            rv = -EFAULT;
+        }
+
+        goto err_out;
+    }
+    else
+    {
+        p_info->inflight.pages_pinned = 1;
+    }
+
+    ezdma_build_sgl( p_info->inflight.table.sgl, p_info->inflight.pinned_pages,
+                     p_info->inflight.num_pages, offset_in_page(userbuf), count );
+
+    // Map the scatterlist for the device doing the DMA.  Behind an IOMMU, the
+    // pages may come out as fewer, longer segments -- usually just one.
+
+    rv = dma_map_sg(ezdma_dma_dev( p_info ),
+                p_info->inflight.table.sgl,
+                p_info->inflight.num_pages,
+                p_info->dir == EZDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+
+    if ( 0 == rv )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: dma_map_sg() of %d pages failed\n", 
+                p_info->name, p_info->inflight.num_pages);
+        rv = -ENOMEM;
+        goto err_out;
+    }
+    else
+    {
+        p_info->inflight.dma_mapped = 1;
+        p_info->inflight.dma_nents = rv;
+    }
+
+    if ( p_info->inflight.dma_nents > 1 && READ_ONCE( p_info->require_contiguous ) )
+    {
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: buffer mapped to %u segments, not one\n",
+                p_info->name, p_info->inflight.dma_nents );
+        rv = -EINVAL;
+        goto err_out;
+    }
+
+    // Issue DMA request here, as one descriptor per chunk
+    {
+        struct ezdma_inflight_info * const inflight = &p_info->inflight;
+        const unsigned int num_pages = inflight->num_pages;
+        const unsigned int chunk_pages = (EZDMA_DEV_TO_CPU == p_info->dir && p_info->rx_chunk_pages) ?
+                                         min( p_info->rx_chunk_pages, num_pages ) : num_pages;
+        struct scatterlist * sg = inflight->table.sgl;
+        struct scatterlist * dma_sg = inflight->table.sgl;
+        size_t dma_left = sg_dma_len( dma_sg );     // of dma_sg, not yet in a chunk
+        unsigned int num_segs = 0;
+        unsigned int c;
+
+        inflight->num_chunks = DIV_ROUND_UP( num_pages, chunk_pages );
+        inflight->chunks_synced = 0;
+
+        if ( inflight->num_chunks > inflight->chunk_capacity &&
+             (rv = ezdma_inflight_grow_chunks( p_info, inflight->num_chunks )) )
+            goto err_out;
+
+        // each chunk boundary can split a segment in two
+        if ( inflight->num_chunks > 1 &&
+             inflight->dma_nents + inflight->num_chunks > inflight->seg_capacity &&
+             (rv = ezdma_inflight_grow_segs( p_info, inflight->dma_nents + inflight->num_chunks )) )
+            goto err_out;
+
+        if ( EZDMA_DEV_TO_CPU == p_info->dir )
+            ezdma_status_begin( p_info );
+
+        for ( c = 0; c < inflight->num_chunks; c++ )
+        {
+            struct ezdma_chunk * const chunk = &inflight->chunks[c];
+            struct dma_async_tx_descriptor * txn_desc;
+            dma_cookie_t cookie;
+            unsigned int i;
+
+            chunk->p_info = p_info;
+            chunk->nents = min( chunk_pages, num_pages - c * chunk_pages );
+            chunk->len = 0;
+            chunk->last = (c == inflight->num_chunks - 1);
+
+            for ( i = 0; i < chunk->nents; i++, sg = sg_next( sg ) )
+                chunk->len += sg->length;
+
+            if ( 1 == inflight->num_chunks )
+            {
+                chunk->dma_sgl = inflight->table.sgl;
+                chunk->dma_nents = inflight->dma_nents;
+            }
+            else
+            {
+                chunk->dma_sgl = &inflight->segs[ num_segs ];
+                chunk->dma_nents = ezdma_carve_segs( chunk->dma_sgl, &dma_sg, &dma_left, chunk->len );
+                num_segs += chunk->dma_nents;
+            }
+
+            txn_desc = dmaengine_prep_slave_sg(
+                    p_info->chan,
+                    chunk->dma_sgl,
+                    chunk->dma_nents,
+                    ezdma_xfer_dir( p_info ),
+                    DMA_PREP_INTERRUPT);    // run callback after this one
+
+            if ( !txn_desc )
+            {
+                printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_prep_slave_sg() failed\n", p_info->name);
+                rv = -ENOMEM;
+                goto err_terminate;
+            }
+
+            txn_desc->callback_result = ezdma_chunk_done;
+            txn_desc->callback_param = chunk;
+
+            // in flight before it's submitted, the callback can come at any time after
+            if ( 0 == c )
+            {
+                raw_spin_lock_irq( &p_info->state_lock );
+
+                p_info->state = DMA_IN_FLIGHT;
+                p_info->submit_cpu = smp_processor_id();
+
+                raw_spin_unlock_irq( &p_info->state_lock );
+            }
+
+            cookie = dmaengine_submit(txn_desc);
+
+            if ( cookie < DMA_MIN_COOKIE )
+            {
+                printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_submit() returned %d\n", p_info->name, cookie);
+                rv = cookie;
+                goto err_terminate;
+            }
+
+            inflight->dma_started = 1;
+        }
+
+        dma_async_issue_pending( p_info->chan );    // Bam!
+        //printk( KERN_ERR KBUILD_MODNAME ": %s: issued pending for %s\n",
+        //        p_info->name,
+        //        p_info->dir == EZDMA_DEV_TO_CPU ? "RX" : "TX" );
+    }
+
+    return 0;
+
+    err_terminate:
+
+    // drop whatever chunks were already submitted
+    if ( p_info->inflight.dma_started )
+        ezdma_terminate( p_info );
 
     err_out:
 
-    spin_lock_irq( &p_info->state_lock );
     ezdma_unprepare_after_dma( p_info );
-    spin_unlock_irq( &p_info->state_lock );
 
     return rv;
 }
 
-// should be called with p_info->sem held, and with p_info_state_lock
+// should be called with p_info->sem held, but not p_info->state_lock
 static void ezdma_unprepare_after_dma( struct ezdma_drvdata * p_info )
 {
-    p_info->state = DMA_IDLE;
-
     if ( p_info->inflight.dma_mapped )
     {
-        dma_unmap_sg(p_info->ezdma_dev,
+        // chunks that completed have already been synced for the CPU
+        const bool synced = p_info->inflight.dma_started &&
+                            p_info->inflight.chunks_synced == p_info->inflight.num_chunks;
+
+        dma_unmap_sg_attrs(ezdma_dma_dev( p_info ),
                 p_info->inflight.table.sgl,
                 p_info->inflight.num_pages,
-                p_info->dir == EZDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+                p_info->dir == EZDMA_DEV_TO_CPU ? DMA_FROM_DEVICE : DMA_TO_DEVICE,
+                synced ? DMA_ATTR_SKIP_CPU_SYNC : 0);
     }
     p_info->inflight.dma_mapped = 0;
 
     if ( p_info->inflight.pages_pinned )
     {
-        if ( p_info->inflight.dma_started && p_info->dir == EZDMA_DEV_TO_CPU )
+        const bool dirty = p_info->inflight.dma_started && p_info->dir == EZDMA_DEV_TO_CPU;
+        int i;
+
+        for (i = 0; i < p_info->inflight.num_pages; ++i)
         {
+            struct page * const page = p_info->inflight.pinned_pages[i];
+
             /* Mark all pages dirty for now (not sure how to do this more
              * efficiently yet -- dmaengine API doesn't seem to return any
              * notion of how much data was actually transferred).
              */
-
-            int i;
-
-            for (i = 0; i < p_info->inflight.num_pages; ++i)
-            {
-                struct page * const page = p_info->inflight.pinned_pages[i];
-
+            if ( dirty )
                 set_page_dirty( page );
-                put_page( page );
-            }
+
+            put_page( page );
         }
     }
     p_info->inflight.pages_pinned = 0;
 
-    if ( p_info->inflight.table_allocated )
-        sg_free_table( &p_info->inflight.table );
-    p_info->inflight.table_allocated = 0;
+    raw_spin_lock_irq( &p_info->state_lock );
+    p_info->state = DMA_IDLE;
+    raw_spin_unlock_irq( &p_info->state_lock );
+
+    if ( p_info->gone )
+        wake_up( &p_info->wq );     // ezdma_unplug() waits for the pages to be let go
+}
+
+// should be called with p_info->sem held
+static void ezdma_inflight_free( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_inflight_info * const inflight = &p_info->inflight;
+
+    if ( inflight->capacity )
+    {
+        sg_free_table( &inflight->table );
+        kfree( inflight->pinned_pages );
+    }
+
+    kfree( inflight->chunks );
+    kfree( inflight->segs );
+
+    inflight->pinned_pages = NULL;
+    inflight->capacity = 0;
+    inflight->chunks = NULL;
+    inflight->chunk_capacity = 0;
+    inflight->segs = NULL;
+    inflight->seg_capacity = 0;
+}
+
+// should be called with p_info->sem held
+static int ezdma_inflight_grow_segs( struct ezdma_drvdata * p_info, unsigned int num_segs )
+{
+    struct ezdma_inflight_info * const inflight = &p_info->inflight;
+    struct scatterlist * segs;
+
+    segs = kmalloc_array_node( num_segs, sizeof(struct scatterlist), GFP_KERNEL, ezdma_numa_node( p_info ) );
+
+    if ( !segs )
+        return -ENOMEM;
+
+    sg_init_table( segs, num_segs );
+
+    kfree( inflight->segs );
+    inflight->segs = segs;
+    inflight->seg_capacity = num_segs;
+
+    return 0;
+}
+
+// should be called with p_info->sem held
+static int ezdma_inflight_grow_chunks( struct ezdma_drvdata * p_info, unsigned int num_chunks )
+{
+    struct ezdma_inflight_info * const inflight = &p_info->inflight;
+    struct ezdma_chunk * chunks;
+
+    chunks = kmalloc_array_node( num_chunks, sizeof(struct ezdma_chunk), GFP_KERNEL, ezdma_numa_node( p_info ) );
+
+    if ( !chunks )
+        return -ENOMEM;
+
+    kfree( inflight->chunks );
+    inflight->chunks = chunks;
+    inflight->chunk_capacity = num_chunks;
+
+    return 0;
+}
+
+// should be called with p_info->sem held
+static int ezdma_inflight_grow( struct ezdma_drvdata * p_info, unsigned int num_pages )
+{
+    struct ezdma_inflight_info * const inflight = &p_info->inflight;
+    struct page ** pages;
+    int rv;
+
+    ezdma_inflight_free( p_info );
+
+    pages = kmalloc_array_node( num_pages, sizeof(struct page*), GFP_KERNEL, ezdma_numa_node( p_info ) );
+
+    if ( !pages )
+        return -ENOMEM;
 
-    if ( p_info->inflight.pinned_pages )
+    if ( (rv = sg_alloc_table( &inflight->table, num_pages, GFP_KERNEL )) )
     {
-        kfree(p_info->inflight.pinned_pages);
-        p_info->inflight.pinned_pages = NULL;
+        printk( KERN_ERR KBUILD_MODNAME ": %s: sg_alloc_table() returned %d\n", 
+                p_info->name, rv);
+        kfree( pages );
+        return rv;
     }
 
+    inflight->pinned_pages = pages;
+    inflight->capacity = num_pages;
+
+    return 0;
+}
+
+static int check_idle( struct ezdma_drvdata * p_info )
+{
+    int rv;
+    raw_spin_lock_irq(&p_info->state_lock);
+
+    rv = (p_info->state == DMA_IDLE);
+
+    raw_spin_unlock_irq(&p_info->state_lock);
+
+    return rv;
 }
 
 static int check_not_in_flight( struct ezdma_drvdata * p_info )
 {
     int rv;
-    spin_lock_irq(&p_info->state_lock);
+    raw_spin_lock_irq(&p_info->state_lock);
     
     rv = (p_info->state != DMA_IN_FLIGHT);
     
-    spin_unlock_irq(&p_info->state_lock);
+    raw_spin_unlock_irq(&p_info->state_lock);
+
+    return rv;
+}
+
+// Waits for the transfer started by read()/write() to finish, giving up after
+// p_info->timeout or when the node is removed.  Cancels the transfer if it's
+// given up on.
+// should be called with p_info->sem held; drops it while waiting
+static int ezdma_wait_for_dma( struct ezdma_drvdata * p_info )
+{
+    const unsigned long timeout = p_info->timeout;
+    int rv;
+
+    up( &p_info->sem );
+
+    if ( timeout )
+    {
+        long left = wait_event_interruptible_timeout( p_info->wq,
+                check_not_in_flight(p_info) || READ_ONCE( p_info->gone ), timeout );
+
+        rv = left < 0 ? left : (0 == left ? -ETIMEDOUT : 0);
+    }
+    else
+    {
+        rv = wait_event_interruptible( p_info->wq, check_not_in_flight(p_info) || READ_ONCE( p_info->gone ) );
+    }
+
+    down( &p_info->sem );
+
+    if ( 0 == rv && !check_not_in_flight( p_info ) )
+        rv = -ENODEV;   // removal terminated it
+
+    // it may yet have finished since we stopped waiting
+    if ( rv && !check_not_in_flight( p_info ) )
+    {
+        ezdma_terminate( p_info );
+
+        if ( -ETIMEDOUT == rv )
+            printk( KERN_WARNING KBUILD_MODNAME ": %s: transfer timed out after %u ms, cancelled\n",
+                    p_info->name, jiffies_to_msecs( timeout ) );
+    }
 
     return rv;
 }
 
 
-// Assume that reads/writes have to be multiples of this.
+// Assume that reads/writes have to be multiples of this, unless the device tree says otherwise.
 #define EZDMA_ALIGN_BYTES (1)
 
 static ssize_t ezdma_read(struct file *filp, char __user *userbuf, size_t count, loff_t *f_pos)
@@ -474,13 +1427,19 @@ static ssize_t ezdma_read(struct file *filp, char __user *userbuf, size_t count,
         return -EINVAL;
     }
 
-    if ( 0 != (count % EZDMA_ALIGN_BYTES) )
+    if ( 0 != (count % p_info->align) )
     {
         printk( KERN_WARNING KBUILD_MODNAME ": %s: unaligned read of %u bytes requested\n", p_info->name, count);
         return -EINVAL;
     }
 
-    //TODO: verify size of count?
+    if ( p_info->max_packet && count > p_info->max_packet )
+        return -EINVAL;
+
+    rv = ezdma_limits_wait( p_info, count, 0, filp->f_flags & O_NONBLOCK );
+    if ( rv )
+        return rv;
+    rv = count;
 
     if ( down_interruptible( &p_info->sem ) )
         return -ERESTARTSYS;
@@ -490,6 +1449,11 @@ static ssize_t ezdma_read(struct file *filp, char __user *userbuf, size_t count,
         rv = -EBADF;
         goto out;
     }
+    else if ( p_info->fwd_peer || p_info->streaming )
+    {
+        rv = -EBUSY;    // channel's buffers are driven from the completion path
+        goto out;
+    }
     else
     {
         int prep_rv;
@@ -503,130 +1467,2934 @@ static ssize_t ezdma_read(struct file *filp, char __user *userbuf, size_t count,
             goto out;
         }
 
-        up( &p_info->sem );
+        wait_rv = ezdma_wait_for_dma( p_info );
+
+        raw_spin_lock_irq(&p_info->state_lock);
+        if ( p_info->state == DMA_IN_FLIGHT && wait_rv )
+            rv = wait_rv;   // cancelled
+        raw_spin_unlock_irq(&p_info->state_lock);
+
+        ezdma_unprepare_after_dma( p_info );    // sets us back to DMA_IDLE
+    }
+
+    out:
+    up( &p_info->sem );
 
-        wait_rv = wait_event_interruptible( p_info->wq, check_not_in_flight(p_info) );
+    return rv;
+}
+
+static ssize_t ezdma_write(struct file *filp, const char __user *userbuf, size_t count, loff_t *f_pos)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)filp->private_data;
+    ssize_t rv = count;
+
+    // Ensure this is a writable device.
+    if ( EZDMA_CPU_TO_DEV != p_info->dir )
+    {
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: can't write, is an RX device\n", p_info->name);
+        return -EINVAL;
+    }
+    if ( 0 != (count % p_info->align) )
+    {
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: unaligned write of %u bytes requested\n", p_info->name, count);
+        return -EINVAL;
+    }
+
+    if ( p_info->max_packet && count > p_info->max_packet )
+        return -EINVAL;
+
+    rv = ezdma_limits_wait( p_info, count, 0, filp->f_flags & O_NONBLOCK );
+    if ( rv )
+        return rv;
+    rv = count;
+
+    if ( down_interruptible( &p_info->sem ) )
+        return -ERESTARTSYS;
+
+    if ( !atomic_read(&p_info->accepting ) )
+    {
+        rv = -EBADF;
+        goto out;
+    }
+    else if ( p_info->fwd_peer || p_info->streaming )
+    {
+        rv = -EBUSY;    // channel's buffers are driven from the completion path
+        goto out;
+    }
+    else if ( atomic_read( &p_info->tx_running ) )
+    {
+        rv = -EBUSY;    // a timeout would terminate the queued TX along with it
+        goto out;
+    }
+    else
+    {
+        int prep_rv;
+        int wait_rv;
+
+        prep_rv = ezdma_prepare_for_dma( p_info, (char __user*)userbuf, count );
+
+        if (prep_rv)
+        {
+            rv = prep_rv;
+            goto out;
+        }
+
+        wait_rv = ezdma_wait_for_dma( p_info );
+
+        raw_spin_lock_irq(&p_info->state_lock);
+        if ( p_info->state == DMA_IN_FLIGHT && wait_rv )
+            rv = wait_rv;   // cancelled
+        raw_spin_unlock_irq(&p_info->state_lock);
+
+        ezdma_unprepare_after_dma( p_info );    // sets us back to DMA_IDLE
+    }
+
+    out:
+    up( &p_info->sem );
+
+    return rv;
+}
+
+/*
+ * Buffer pools.
+ *
+ * Pool buffers are plain (cached) pages with a streaming DMA mapping on the
+ * channel's DMA device, so ownership has to be handed back and forth with
+ * dma_sync_single_for_{device,cpu}() as buffers move between the engine and
+ * userspace.
+ *
+ * EZDMA_POOL_CONTIG pools instead come from dma_alloc_coherent(), which can
+ * hand out contiguous buffers bigger than the page allocator will (from CMA,
+ * or the device's reserved-memory region), and need no syncing.  A channel
+ * with a "memory-region" always gets those, carved from the region.
+ */
+
+static void ezdma_pool_free( struct ezdma_drvdata * p_info );
+
+// should be called with p_info->sem held
+static int ezdma_pool_alloc(
+        struct ezdma_drvdata * p_info,
+        struct ezdma_pool_class * classes,
+        unsigned int num_classes,
+        u32 flags
+)
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+    struct device * const dev = p_info->rmem_dev ? p_info->rmem_dev : ezdma_dma_dev( p_info );
+    const enum dma_data_direction dir = ezdma_data_dir( p_info );
+    const int node = ezdma_numa_node( p_info );
+    const bool coherent = (flags & EZDMA_POOL_CONTIG) || p_info->rmem_dev;
+    unsigned int total = 0;
+    unsigned int c, i;
+
+    if ( pool->count )
+        return -EBUSY;
+
+    if ( 0 == num_classes || num_classes > EZDMA_POOL_MAX_CLASSES || (flags & ~EZDMA_POOL_CONTIG) )
+        return -EINVAL;
+
+    for ( c = 0; c < num_classes; c++ )
+    {
+        if ( 0 == classes[c].count || classes[c].count > EZDMA_POOL_MAX_BUFS || 0 == classes[c].size )
+            return -EINVAL;
+
+        if ( c > 0 && classes[c].size <= classes[c-1].size )
+            return -EINVAL;
+
+        total += classes[c].count;
+    }
+
+    if ( total > EZDMA_POOL_MAX_BUFS )
+        return -EINVAL;
+
+    pool->bufs = kcalloc_node( total, sizeof(struct ezdma_buf), GFP_KERNEL, node );
+
+    if ( !pool->bufs )
+        return -ENOMEM;
+
+    pool->dev = dev;
+    pool->num_classes = num_classes;
+    pool->coherent = coherent;
+    pool->dir = dir;
+    atomic_set( &pool->mmap_count, 0 );
+
+    for ( c = 0; c < num_classes; c++ )
+    {
+        struct ezdma_buf_class * const cls = &pool->classes[c];
+        unsigned int per_page;
+
+        cls->first = pool->count;
+        cls->count = classes[c].count;
+        cls->size = classes[c].size;
+        INIT_LIST_HEAD( &cls->free );
+
+        /* Buffers smaller than a page share pages, but never cache lines, so
+         * that syncing one can't disturb its neighbours.  Coherent buffers are
+         * allocated one by one. */
+        cls->stride = coherent ? PAGE_ALIGN( cls->size ) : ALIGN( cls->size, dma_get_cache_alignment() );
+        per_page = cls->stride < PAGE_SIZE ? PAGE_SIZE / cls->stride : 1;
+
+        for ( i = 0; i < cls->count; i++ )
+        {
+            struct ezdma_buf * const buf = &pool->bufs[ pool->count ];
+            const unsigned int slot = i % per_page;
+
+            if ( coherent )
+            {
+                buf->vaddr = dma_alloc_coherent( dev, cls->size, &buf->map_dma, GFP_KERNEL | __GFP_NOWARN );
+
+                if ( !buf->vaddr )
+                    goto err_out;
+
+                buf->map_size = cls->size;
+            }
+            else if ( 0 == slot )
+            {
+                buf->order = get_order( cls->size );
+                buf->map_size = per_page > 1 ? PAGE_SIZE : cls->size;
+                buf->page = alloc_pages_node( node, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN, buf->order );
+
+                if ( !buf->page )
+                    goto err_out;
+
+                buf->map_dma = dma_map_page( dev, buf->page, 0, buf->map_size, dir );
+
+                if ( dma_mapping_error( dev, buf->map_dma ) )
+                {
+                    __free_pages( buf->page, buf->order );
+                    goto err_out;
+                }
+
+                // userspace owns the buffer until it's handed to the engine
+                dma_sync_single_for_cpu( dev, buf->map_dma, buf->map_size, dir );
+            }
+            else
+            {
+                const struct ezdma_buf * const page_owner = buf - slot;
+
+                buf->order = page_owner->order;
+                buf->page = page_owner->page;
+                buf->map_dma = page_owner->map_dma;
+            }
+
+            buf->p_info = p_info;
+            buf->idx = pool->count;
+            buf->cls = c;
+            buf->offset = slot * cls->stride;
+            if ( !coherent )
+                buf->vaddr = page_address( buf->page ) + buf->offset;
+            buf->dma = buf->map_dma + buf->offset;
+            buf->size = cls->size;
+            buf->owner = EZDMA_BUF_USER;
+
+            pool->count++;
+        }
+
+        classes[c].first = cls->first;
+        classes[c].stride = cls->stride;
+    }
+
+    return 0;
+
+    err_out:
+
+    printk( KERN_ERR KBUILD_MODNAME ": %s: couldn't allocate pool buffer %u of %u\n",
+            p_info->name, pool->count, total );
+
+    ezdma_pool_free( p_info );
+
+    return -ENOMEM;
+}
+
+// should be called with p_info->sem held, and with no buffers owned by the engine
+static void ezdma_pool_free( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+    unsigned int i;
+
+    if ( !pool->bufs )
+        return;
+
+    for ( i = 0; i < pool->count; i++ )
+    {
+        struct ezdma_buf * const buf = &pool->bufs[i];
+
+        if ( !buf->map_size )
+            continue;   // shares its page with an earlier buffer
+
+        if ( pool->coherent )
+        {
+            dma_free_coherent( pool->dev, buf->map_size, buf->vaddr, buf->map_dma );
+        }
+        else
+        {
+            dma_unmap_page( pool->dev, buf->map_dma, buf->map_size, pool->dir );
+            __free_pages( buf->page, buf->order );
+        }
+    }
+
+    kfree( pool->bufs );
+    pool->bufs = NULL;
+    pool->count = 0;
+    pool->num_classes = 0;
+    pool->coherent = false;
+}
+
+// frees the pool, and the reserved memory it came from, once the node is removed
+// should be called with p_info->sem held, and with the pool no longer mapped
+static void ezdma_free_removed_pool( struct ezdma_drvdata * p_info )
+{
+    ezdma_pool_free( p_info );
+
+    if ( p_info->rmem_dev )
+        of_reserved_mem_device_release( p_info->rmem_dev );
+    p_info->rmem_dev = NULL;
+
+    if ( p_info->pool_pinned )
+        put_device( p_info->pool_pinned );
+    p_info->pool_pinned = NULL;
+}
+
+static inline void ezdma_buf_sync_for_cpu( struct ezdma_buf * buf, size_t len )
+{
+    if ( buf->p_info->pool.coherent )
+        return;
+
+    dma_sync_single_range_for_cpu( buf->p_info->pool.dev, buf->map_dma, buf->offset, len,
+            buf->p_info->pool.dir );
+}
+
+static inline void ezdma_buf_sync_for_device( struct ezdma_buf * buf, size_t len )
+{
+    if ( buf->p_info->pool.coherent )
+        return;
+
+    dma_sync_single_range_for_device( buf->p_info->pool.dev, buf->map_dma, buf->offset, len,
+            buf->p_info->pool.dir );
+}
+
+/* Maps the pool's pages again, for dir.  Every new mapping is made before an
+ * old one goes, so a failure leaves the pool as it was.  The buffers end up
+ * owned by the engine.
+ * should be called with p_info->sem held, and with no buffers owned by the engine */
+static int ezdma_pool_remap( struct ezdma_drvdata * p_info, enum dma_data_direction dir )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+    dma_addr_t map_dma = 0;
+    unsigned int i;
+
+    if ( pool->coherent || pool->dir == dir )
+        return 0;
+
+    // fwd_dma holds the new mapping until they're all made
+    for ( i = 0; i < pool->count; i++ )
+    {
+        struct ezdma_buf * const buf = &pool->bufs[i];
+
+        if ( !buf->map_size )
+            continue;   // shares its page with an earlier buffer
+
+        buf->fwd_dma = dma_map_page( pool->dev, buf->page, 0, buf->map_size, dir );
+
+        if ( dma_mapping_error( pool->dev, buf->fwd_dma ) )
+        {
+            while ( i-- > 0 )
+                if ( pool->bufs[i].map_size )
+                    dma_unmap_page( pool->dev, pool->bufs[i].fwd_dma, pool->bufs[i].map_size, dir );
+
+            return -ENOMEM;
+        }
+    }
+
+    for ( i = 0; i < pool->count; i++ )
+    {
+        struct ezdma_buf * const buf = &pool->bufs[i];
+
+        if ( buf->map_size )
+        {
+            dma_unmap_page( pool->dev, buf->map_dma, buf->map_size, pool->dir );
+            map_dma = buf->fwd_dma;
+        }
+
+        buf->map_dma = map_dma;
+        buf->dma = map_dma + buf->offset;
+    }
+
+    pool->dir = dir;
+
+    return 0;
+}
+
+static void ezdma_vma_open( struct vm_area_struct * vma )
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)vma->vm_private_data;
+
+    atomic_inc( &p_info->pool.mmap_count );
+}
+
+static void ezdma_vma_close( struct vm_area_struct * vma )
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)vma->vm_private_data;
+
+    atomic_dec( &p_info->pool.mmap_count );
+}
+
+static const struct vm_operations_struct ezdma_vm_ops = {
+    .open   = ezdma_vma_open,
+    .close  = ezdma_vma_close,
+};
+
+/* The page offset selects the pool buffer; each mmap() maps exactly one.
+ * Buffers packed into a shared page are mapped along with their neighbours,
+ * at their offset within the page. */
+static int ezdma_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)filp->private_data;
+    const unsigned long len = vma->vm_end - vma->vm_start;
+    struct ezdma_buf * buf;
+    int rv;
+
+    if ( down_interruptible( &p_info->sem ) )
+        return -ERESTARTSYS;
+
+    if ( p_info->gone )
+    {
+        rv = -ENODEV;
+        goto out;
+    }
+
+    if ( EZDMA_STATUS_PGOFF == vma->vm_pgoff )
+    {
+        rv = ezdma_mmap_status( p_info, vma );
+        goto out;
+    }
+
+    if ( vma->vm_pgoff >= p_info->pool.count )
+    {
+        rv = -EINVAL;
+        goto out;
+    }
+
+    buf = &p_info->pool.bufs[ vma->vm_pgoff ];
+
+    if ( len > PAGE_ALIGN( buf->offset + buf->size ) )
+    {
+        rv = -EINVAL;
+        goto out;
+    }
+
+    if ( p_info->pool.coherent )
+    {
+        vma->vm_pgoff = 0;  // it's the buffer index, not an offset into the buffer
+        rv = dma_mmap_coherent( p_info->pool.dev, vma, buf->vaddr, buf->map_dma, buf->map_size );
+    }
+    else
+    {
+        rv = remap_pfn_range( vma, vma->vm_start, page_to_pfn( buf->page ), len, vma->vm_page_prot );
+    }
+
+    if ( !rv )
+    {
+        vma->vm_ops = &ezdma_vm_ops;
+        vma->vm_private_data = p_info;
+        ezdma_vma_open( vma );
+    }
+
+    out:
+    up( &p_info->sem );
+
+    return rv;
+}
+
+
+/*
+ * RX->TX forwarding.
+ *
+ * Every buffer of the RX channel's pool circulates between the two engines
+ * entirely from the completion callbacks:  RX completes -> submitted as-is on
+ * TX -> TX completes -> posted back to RX.  The CPU never touches the data
+ * while forwarding is bound, so no cache maintenance is done per packet --
+ * the buffers are synced once when they're handed over at bind time and once
+ * more when they're handed back at unbind.
+ */
+
+static int ezdma_fwd_post_rx( struct ezdma_buf * buf );
+static int ezdma_fwd_post_tx( struct ezdma_buf * buf );
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_fwd_rx_done( void * data, const struct dmaengine_result * result )
+{
+    struct ezdma_buf * const buf = (struct ezdma_buf*)data;
+    struct ezdma_drvdata * const rx = buf->p_info;
+
+    if ( !atomic_read( &rx->fwd_running ) )
+        return;
+
+    if ( DMA_TRANS_NOERROR != result->result )
+    {
+        atomic_inc( &rx->fwd_errors );
+        goto repost;
+    }
+
+    buf->len = buf->size - result->residue;
+    atomic_inc( &rx->packets_rcvd );
+
+    if ( 0 == buf->len )
+        goto repost;
+
+    if ( 0 == ezdma_fwd_post_tx( buf ) )
+        return;
+
+    atomic_inc( &rx->fwd_errors );  // drop it, and keep receiving
+
+    repost:
+    if ( ezdma_fwd_post_rx( buf ) )
+        atomic_inc( &rx->fwd_errors );  // buffer drops out of circulation
+}
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_fwd_tx_done( void * data, const struct dmaengine_result * result )
+{
+    struct ezdma_buf * const buf = (struct ezdma_buf*)data;
+    struct ezdma_drvdata * const rx = buf->p_info;
+
+    if ( !atomic_read( &rx->fwd_running ) )
+        return;
+
+    if ( DMA_TRANS_NOERROR != result->result )
+        atomic_inc( &rx->fwd_errors );
+    else
+        atomic_inc( &rx->fwd_peer->packets_sent );
+
+    if ( ezdma_fwd_post_rx( buf ) )
+        atomic_inc( &rx->fwd_errors );
+}
+
+static int ezdma_fwd_post_rx( struct ezdma_buf * buf )
+{
+    struct ezdma_drvdata * const rx = buf->p_info;
+    struct dma_async_tx_descriptor * txn_desc;
+
+    txn_desc = dmaengine_prep_slave_single( rx->chan, buf->dma, buf->size,
+            DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT );
+
+    if ( !txn_desc )
+        return -ENOMEM;
+
+    ezdma_set_callback( txn_desc, buf, ezdma_fwd_rx_done );
+
+    if ( dma_submit_error( dmaengine_submit( txn_desc ) ) )
+        return -EIO;
+
+    dma_async_issue_pending( rx->chan );
+
+    return 0;
+}
+
+static int ezdma_fwd_post_tx( struct ezdma_buf * buf )
+{
+    struct ezdma_drvdata * const tx = buf->p_info->fwd_peer;
+    struct dma_async_tx_descriptor * txn_desc;
+
+    txn_desc = dmaengine_prep_slave_single( tx->chan, buf->fwd_dma, buf->len,
+            DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT );
+
+    if ( !txn_desc )
+        return -ENOMEM;
+
+    ezdma_set_callback( txn_desc, buf, ezdma_fwd_tx_done );
+
+    if ( dma_submit_error( dmaengine_submit( txn_desc ) ) )
+        return -EIO;
+
+    dma_async_issue_pending( tx->chan );
+
+    return 0;
+}
+
+// undo the TX-side mappings of the first num_bufs pool buffers
+static void ezdma_fwd_unmap( struct ezdma_drvdata * rx, struct ezdma_drvdata * tx, unsigned int num_bufs )
+{
+    struct device * const tx_dev = ezdma_dma_dev( tx );
+    unsigned int i;
+
+    if ( tx_dev == rx->pool.dev )
+    {
+        // buffers were shared; if this fails, they just stay mapped both ways
+        ezdma_pool_remap( rx, ezdma_data_dir( rx ) );
+        return;
+    }
+
+    for ( i = 0; i < num_bufs; i++ )
+        dma_unmap_page( tx_dev, rx->pool.bufs[i].fwd_dma, rx->pool.bufs[i].size, DMA_TO_DEVICE );
+}
+
+// should be called with rx->sem held
+static void ezdma_fwd_unbind( struct ezdma_drvdata * rx )
+{
+    struct ezdma_drvdata * const tx = rx->fwd_peer;
+    unsigned int i;
+
+    /* Stop the callbacks from resubmitting, then flush both channels.  A TX
+     * callback that was already running can still post to RX after RX has
+     * been flushed once, hence the second RX flush. */
+    atomic_set( &rx->fwd_running, 0 );
+    smp_mb();
+
+    ezdma_terminate( rx );
+
+    down( &tx->sem );   // RX's sem comes first
+
+    ezdma_terminate( tx );
+    ezdma_terminate( rx );
+
+    ezdma_fwd_unmap( rx, tx, rx->pool.count );
+    tx->fwd_peer = NULL;
+
+    up( &tx->sem );
+
+    for ( i = 0; i < rx->pool.count; i++ )
+    {
+        struct ezdma_buf * const buf = &rx->pool.bufs[i];
+
+        ezdma_buf_sync_for_cpu( buf, buf->size );
+        buf->owner = EZDMA_BUF_USER;
+    }
+
+    rx->fwd_peer = NULL;
+    fput( rx->fwd_filp );
+    rx->fwd_filp = NULL;
+
+    if ( atomic_read( &rx->fwd_errors ) )
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: forwarding to %s stopped after %d errors\n",
+                rx->name, tx->name, atomic_read( &rx->fwd_errors ) );
+}
+
+// should be called with rx->sem held
+static int ezdma_fwd_bind( struct ezdma_drvdata * rx, int tx_fd )
+{
+    struct file * tx_filp;
+    struct ezdma_drvdata * tx;
+    struct device * tx_dev;
+    unsigned int i;
+    int rv;
+
+    // every buffer has to be able to hold a whole packet
+    if ( EZDMA_DEV_TO_CPU != rx->dir || 1 != rx->pool.num_classes )
+        return -EINVAL;
+
+    // a prepared descriptor would keep the addresses the pool is remapped from
+    if ( rx->fwd_peer || rx->streaming || rx->prep_buf || !check_not_in_flight( rx ) )
+        return -EBUSY;
+
+    if ( NULL == (tx_filp = fget( tx_fd )) )
+        return -EBADF;
+
+    if ( tx_filp->f_op != &ezdma_fops )
+    {
+        rv = -EINVAL;
+        goto err_fput;
+    }
+
+    tx = (struct ezdma_drvdata*)tx_filp->private_data;
+
+    if ( EZDMA_CPU_TO_DEV != tx->dir )
+    {
+        rv = -EINVAL;
+        goto err_fput;
+    }
+
+    if ( down_interruptible( &tx->sem ) )
+    {
+        rv = -ERESTARTSYS;
+        goto err_fput;
+    }
+
+    if ( tx->gone )
+    {
+        rv = -ENODEV;
+        goto err_up;
+    }
+
+    // the channel can only carry one kind of traffic at a time
+    if ( tx->fwd_peer || tx->group || atomic_read( &tx->tx_running ) || !check_not_in_flight( tx ) )
+    {
+        rv = -EBUSY;
+        goto err_up;
+    }
+
+    tx_dev = ezdma_dma_dev( tx );
+
+    // coherent buffers have no pages to map for another device
+    if ( rx->pool.coherent && tx_dev != rx->pool.dev )
+    {
+        rv = -EINVAL;
+        goto err_up;
+    }
+
+    // on the same device, RX lands in the very mapping TX then reads from
+    if ( tx_dev == rx->pool.dev && (rv = ezdma_pool_remap( rx, DMA_BIDIRECTIONAL )) )
+        goto err_up;
+
+    for ( i = 0; i < rx->pool.count; i++ )
+    {
+        struct ezdma_buf * const buf = &rx->pool.bufs[i];
+
+        if ( tx_dev == rx->pool.dev )
+        {
+            buf->fwd_dma = buf->dma;
+            continue;
+        }
+
+        buf->fwd_dma = dma_map_page( tx_dev, buf->page, buf->offset, buf->size, DMA_TO_DEVICE );
+
+        if ( dma_mapping_error( tx_dev, buf->fwd_dma ) )
+        {
+            ezdma_fwd_unmap( rx, tx, i );
+            rv = -ENOMEM;
+            goto err_up;
+        }
+    }
+
+    tx->fwd_peer = rx;
+    up( &tx->sem );
+
+    rx->fwd_peer = tx;
+    rx->fwd_filp = tx_filp;
+    atomic_set( &rx->fwd_errors, 0 );
+    atomic_set( &rx->fwd_running, 1 );
+
+    for ( i = 0; i < rx->pool.count; i++ )
+    {
+        struct ezdma_buf * const buf = &rx->pool.bufs[i];
+
+        ezdma_buf_sync_for_device( buf, buf->size );
+        buf->owner = EZDMA_BUF_HW;
+
+        if ( (rv = ezdma_fwd_post_rx( buf )) )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": %s: couldn't post forwarding buffer %u\n",
+                    rx->name, i );
+            ezdma_fwd_unbind( rx );
+            return rv;
+        }
+    }
+
+    printk( KERN_INFO KBUILD_MODNAME ": %s: forwarding to %s\n", rx->name, tx->name );
+
+    return 0;
+
+    err_up:
+    up( &tx->sem );
+
+    err_fput:
+    fput( tx_filp );
+
+    return rv;
+}
+
+/*
+ * Completion groups and streaming.
+ *
+ * A streaming channel keeps its pool buffers posted to the engine.  Each
+ * completion is turned into a struct ezdma_completion on the group's ring,
+ * and the buffer stays with userspace until the record is written back to the
+ * group fd.
+ */
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_group_push( struct ezdma_group * group, const struct ezdma_completion * compl )
+{
+    struct ezdma_completion rec = *compl;
+    unsigned long iflags;
+
+    spin_lock_irqsave( &group->lock, iflags );
+
+    /* The ring has a slot for every buffer of every member, so this can only
+     * fail if userspace requeued a buffer whose record it hadn't read yet.
+     * The next record that fits tells the consumer it missed some. */
+    if ( group->dropped )
+        rec.flags |= EZDMA_COMPL_LOST;
+
+    if ( kfifo_put( &group->ring, rec ) )
+        group->dropped = 0;
+    else
+        group->dropped++;
+
+    spin_unlock_irqrestore( &group->lock, iflags );
+
+    wake_up_interruptible( &group->wq );
+}
+
+static unsigned int ezdma_stream_refill( struct ezdma_drvdata * p_info );
+
+// put a buffer back on its free list, unreported.  should be called with p_info->pool.lock held
+static inline void ezdma_stream_recycle( struct ezdma_buf * buf )
+{
+    buf->owner = EZDMA_BUF_FREE;
+    buf->chain_next = NULL;
+    buf->clean = 0;
+    list_add_tail( &buf->node, &buf->p_info->pool.classes[ buf->cls ].free );
+}
+
+// ... and every buffer of a descriptor.  should be called with p_info->pool.lock held
+static inline void ezdma_stream_recycle_chain( struct ezdma_buf * head )
+{
+    struct ezdma_buf * buf;
+    struct ezdma_buf * next;
+
+    for ( buf = head; buf; buf = next )
+    {
+        next = buf->chain_next;
+        ezdma_stream_recycle( buf );
+    }
+}
+
+/* Takes back the buffers of the channel's oldest packet which is still on the
+ * group's ring, unread, and drops its records.  Only the head of the ring can
+ * be dropped, so this fails if that belongs to another channel.
+ *
+ * should be called with p_info->pool.lock held
+ */
+static bool ezdma_stream_reclaim_oldest( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_group * const group = p_info->group;
+    struct ezdma_completion compl;
+    bool reclaimed = false;
+
+    spin_lock( &group->lock );
+
+    while ( kfifo_peek( &group->ring, &compl ) && compl.chan == p_info->group_idx )
+    {
+        kfifo_skip( &group->ring );
+        ezdma_stream_recycle( &p_info->pool.bufs[ compl.buf ] );
+        reclaimed = true;
+
+        if ( !(compl.flags & EZDMA_COMPL_MORE) )
+            break;  // that was the whole packet
+    }
+
+    spin_unlock( &group->lock );
+
+    return reclaimed;
+}
+
+/* The consumer has every buffer but the ones of the packet that just landed,
+ * so the engine is out of buffers.  Applies the channel's overrun policy.
+ *
+ * Returns true if the packet should still be reported.
+ *
+ * should be called with p_info->pool.lock held
+ */
+static bool ezdma_stream_overrun( struct ezdma_drvdata * p_info, struct ezdma_buf * head )
+{
+    atomic_inc( &p_info->overruns );
+    p_info->overrun_flag = true;
+
+    switch ( READ_ONCE( p_info->overrun_policy ) )
+    {
+        case EZDMA_OVERRUN_STOP:
+            atomic_set( &p_info->stream_running, 0 );
+            return true;
+
+        case EZDMA_OVERRUN_OVERWRITE:
+            if ( ezdma_stream_reclaim_oldest( p_info ) )
+                return true;
+            fallthrough;    // all that's left is to drop this one
+
+        case EZDMA_OVERRUN_DROP:
+            ezdma_stream_recycle_chain( head );
+            return false;
+
+        default:    // EZDMA_OVERRUN_STALL
+            return true;
+    }
+}
+
+/* Runs the RX filter on a packet of len bytes which starts in head, whose
+ * data must already be the CPU's.  Returns its verdict, and for
+ * EZDMA_FILTER_STEER the subchannel in *subchan.
+ *
+ * should be called with p_info->pool.lock held
+ */
+static u32 ezdma_filter_run( struct ezdma_drvdata * p_info, struct ezdma_buf * head, size_t len, u32 * subchan )
+{
+    const struct ezdma_filter * const filter = &p_info->filter;
+    const size_t avail = min( len, head->size );
+    unsigned int i;
+
+    for ( i = 0; i < filter->num_rules; i++ )
+    {
+        const struct ezdma_filter_rule * const rule = &filter->rules[i];
+        u32 word;
+
+        if ( rule->offset >= avail || avail - rule->offset < sizeof(word) )
+            continue;
+
+        memcpy( &word, head->vaddr + rule->offset, sizeof(word) );
+
+        if ( (word & rule->mask) == rule->value )
+        {
+            *subchan = rule->subchan;
+            return rule->verdict;
+        }
+    }
+
+    return filter->default_verdict;
+}
+
+// checks rules from userspace before they get near the completion path
+static int ezdma_filter_check( const struct ezdma_filter * filter )
+{
+    unsigned int i;
+
+    if ( filter->num_rules > EZDMA_FILTER_MAX_RULES || filter->default_verdict > EZDMA_FILTER_DROP )
+        return -EINVAL;
+
+    for ( i = 0; i < filter->num_rules; i++ )
+    {
+        const struct ezdma_filter_rule * const rule = &filter->rules[i];
+
+        if ( rule->verdict > EZDMA_FILTER_TRIGGER || (rule->value & ~rule->mask) )
+            return -EINVAL;     // the latter could never match
+
+        if ( EZDMA_FILTER_STEER == rule->verdict && (rule->subchan < 1 || rule->subchan > 0xff) )
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Triggered capture.  While a capture is armed, every record of a packet is
+ * kept on capture_hist (its buffers marked captured) instead of being pushed
+ * to the group, until a trigger and enough data after it; then they're all
+ * pushed at once.
+ */
+
+// should be called with p_info->pool.lock held
+static void ezdma_capture_hold( struct ezdma_drvdata * p_info, struct ezdma_buf * buf, const struct ezdma_completion * compl )
+{
+    buf->owner = EZDMA_BUF_CAPTURED;
+    buf->held_compl = *compl;
+    list_add_tail( &buf->node, &p_info->capture_hist );
+}
+
+// bytes of the oldest packet held.  should be called with p_info->pool.lock held
+static size_t ezdma_capture_oldest_len( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_buf * buf;
+    size_t len = 0;
+
+    list_for_each_entry( buf, &p_info->capture_hist, node )
+    {
+        len += buf->held_compl.len;
+
+        if ( !(buf->held_compl.flags & EZDMA_COMPL_MORE) )
+            break;
+    }
+
+    return len;
+}
+
+// let go of the oldest packet held.  should be called with p_info->pool.lock held
+static void ezdma_capture_drop_oldest( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_buf * buf;
+
+    while ( (buf = list_first_entry_or_null( &p_info->capture_hist, struct ezdma_buf, node )) )
+    {
+        const bool more = buf->held_compl.flags & EZDMA_COMPL_MORE;
+
+        list_del( &buf->node );
+        p_info->capture_held -= min_t( u64, buf->held_compl.len, p_info->capture_held );
+        ezdma_stream_recycle( buf );
+
+        if ( !more )
+            break;
+    }
+}
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+// should be called with p_info->pool.lock held
+static void ezdma_capture_deliver( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_buf * buf;
+    struct ezdma_buf * tmp;
+
+    list_for_each_entry_safe( buf, tmp, &p_info->capture_hist, node )
+    {
+        list_del( &buf->node );
+        buf->owner = EZDMA_BUF_USER;
+        ezdma_group_push( p_info->group, &buf->held_compl );
+    }
+
+    p_info->capture_held = 0;
+    p_info->capture_collected = 0;
+    p_info->capture_triggered = false;  // and armed for the next one
+    atomic_inc( &p_info->captures );
+}
+
+/* Accounts for a packet of len bytes just held, and trims the history or
+ * finishes the capture as needed.
+ *
+ * should be called with p_info->pool.lock held
+ */
+static void ezdma_capture_advance( struct ezdma_drvdata * p_info, size_t len )
+{
+    struct list_head * const largest = &p_info->pool.classes[ p_info->pool.num_classes - 1 ].free;
+
+    if ( p_info->capture_triggered )
+    {
+        p_info->capture_collected += len;
+
+        // cut short rather than leave the engine nowhere to put the next packet
+        if ( p_info->capture_collected >= p_info->capture_post ||
+             (0 == p_info->stream_posted && list_empty( largest )) )
+            ezdma_capture_deliver( p_info );
+
+        return;
+    }
+
+    p_info->capture_held += len;
+
+    // keep at least capture_pre bytes, but not a whole packet more than that
+    while ( !list_empty( &p_info->capture_hist ) &&
+            p_info->capture_held - ezdma_capture_oldest_len( p_info ) >= p_info->capture_pre )
+        ezdma_capture_drop_oldest( p_info );
+
+    while ( !list_empty( &p_info->capture_hist ) && 0 == p_info->stream_posted && list_empty( largest ) )
+        ezdma_capture_drop_oldest( p_info );
+}
+
+/* Arms (or with both sizes 0, disarms) capture.  Anything held for the
+ * previous setting goes back to the engine.
+ *
+ * should be called with p_info->sem held
+ */
+static void ezdma_capture_arm( struct ezdma_drvdata * p_info, const struct ezdma_capture * cap )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+
+    spin_lock_irq( &pool->lock );
+
+    while ( !list_empty( &p_info->capture_hist ) )
+        ezdma_capture_drop_oldest( p_info );
+
+    p_info->capture_armed = cap->pre_bytes || cap->post_bytes;
+    p_info->capture_pre = cap->pre_bytes;
+    p_info->capture_post = cap->post_bytes;
+    p_info->capture_held = 0;
+    p_info->capture_collected = 0;
+    p_info->capture_trigger = false;
+    p_info->capture_triggered = false;
+
+    if ( atomic_read( &p_info->stream_running ) )
+        ezdma_stream_refill( p_info );
+
+    spin_unlock_irq( &pool->lock );
+
+    dma_async_issue_pending( p_info->chan );
+}
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_stream_rx_done( void * data, const struct dmaengine_result * result )
+{
+    struct ezdma_buf * const head = (struct ezdma_buf*)data;
+    struct ezdma_drvdata * const p_info = head->p_info;
+    struct ezdma_pool * const pool = &p_info->pool;
+    const bool error = (DMA_TRANS_NOERROR != result->result);
+    struct ezdma_buf * buf;
+    struct ezdma_buf * next;
+    size_t left = 0;
+    unsigned long iflags;
+    bool head_synced = false;
+    bool trigger = false;
+    u32 trigger_flag = 0;
+    size_t landed;
+    const bool crc = READ_ONCE( p_info->crc ) && !error;
+    u32 crc_state = ~0;     // runs across the packet's records
+    u32 subchan = 0;
+    u32 seq;
+
+    if ( !atomic_read( &p_info->stream_running ) )
+        return;
+
+    if ( !error )
+    {
+        for ( buf = head; buf; buf = buf->chain_next )
+            left += buf->size;
+
+        left = result->residue < left ? left - result->residue : 0;
+        atomic_inc( &p_info->packets_rcvd );
+    }
+
+    landed = left;
+
+    spin_lock_irqsave( &pool->lock, iflags );
+
+    p_info->stream_posted--;
+
+    if ( !error && p_info->filter.num_rules )
+    {
+        u32 verdict;
+
+        // the rules look at the data, so it has to be the CPU's first
+        ezdma_buf_sync_for_cpu( head, min( left, head->size ) );
+        head_synced = true;
+
+        verdict = ezdma_filter_run( p_info, head, left, &subchan );
+        atomic_inc( &p_info->filter_verdicts[ verdict ] );
+
+        // not even a sequence number: as far as the consumer knows, it never came
+        if ( EZDMA_FILTER_DROP == verdict )
+        {
+            ezdma_stream_recycle_chain( head );
+            goto refill;
+        }
+
+        if ( EZDMA_FILTER_STEER != verdict )
+            subchan = 0;
+
+        trigger = (EZDMA_FILTER_TRIGGER == verdict);
+    }
+
+    seq = p_info->compl_seq++;  // dropped packets use up theirs too, leaving a gap
+
+    // while capturing, running out of buffers is the capture's business
+    if ( !p_info->capture_armed &&
+         0 == p_info->stream_posted &&
+         list_empty( &pool->classes[ pool->num_classes - 1 ].free ) &&
+         !ezdma_stream_overrun( p_info, head ) )
+        goto refill;
+
+    if ( p_info->capture_armed && !p_info->capture_triggered && (trigger || p_info->capture_trigger) )
+    {
+        p_info->capture_triggered = true;
+        p_info->capture_trigger = false;
+        trigger_flag = EZDMA_COMPL_TRIGGER;
+    }
+
+    for ( buf = head; buf; buf = next )
+    {
+        const size_t len = min( left, buf->size );
+        struct ezdma_completion compl = {
+            .chan   = p_info->group_idx,
+            .buf    = buf->idx,
+            .len    = len,
+            .seq    = seq,
+        };
+
+        next = buf->chain_next;
+        buf->chain_next = NULL;
+
+        /* The packet never reached this buffer, so it can go straight back to
+         * the engine without being reported (or synced -- nothing touched it). */
+        if ( buf != head && 0 == len )
+        {
+            buf->owner = EZDMA_BUF_FREE;
+            list_add_tail( &buf->node, &pool->classes[ buf->cls ].free );
+            continue;
+        }
+
+        // only what actually landed needs to be made visible to the CPU
+        if ( buf != head || !head_synced )
+            ezdma_buf_sync_for_cpu( buf, len );
+
+        // while the data is still hot from the sync
+        if ( crc )
+        {
+            crc_state = crc32c( crc_state, buf->vaddr, len );
+            compl.crc = ~crc_state;
+            compl.flags |= EZDMA_COMPL_CRC;
+        }
+
+        buf->len = len;
+        buf->owner = EZDMA_BUF_USER;
+        buf->clean = 0;
+        left -= len;
+
+        if ( error )
+            compl.flags |= EZDMA_COMPL_ERROR;
+
+        if ( left )
+            compl.flags |= EZDMA_COMPL_MORE;
+
+        compl.flags |= subchan << EZDMA_COMPL_SUBCHAN_SHIFT;
+        compl.flags |= trigger_flag;
+
+        if ( p_info->overrun_flag )
+        {
+            compl.flags |= EZDMA_COMPL_OVERRUN;
+            p_info->overrun_flag = left;    // flag every record of the packet
+        }
+
+        if ( p_info->capture_armed )
+            ezdma_capture_hold( p_info, buf, &compl );
+        else
+            ezdma_group_push( p_info->group, &compl );
+    }
+
+    if ( p_info->capture_armed )
+        ezdma_capture_advance( p_info, landed );
+
+    refill:
+    if ( atomic_read( &p_info->stream_running ) )
+        ezdma_stream_refill( p_info );
+
+    spin_unlock_irqrestore( &pool->lock, iflags );
+
+    dma_async_issue_pending( p_info->chan );
+}
+
+// Hand a chain of pool buffers to the engine as one descriptor.  Caller issues pending.
+static int ezdma_stream_post( struct ezdma_drvdata * p_info, struct ezdma_buf ** chain, unsigned int n )
+{
+    struct scatterlist sgl[EZDMA_POOL_MAX_CLASSES];
+    struct dma_async_tx_descriptor * txn_desc;
+    unsigned int i;
+
+    sg_init_table( sgl, n );
+
+    for ( i = 0; i < n; i++ )
+    {
+        struct ezdma_buf * const buf = chain[i];
+
+        if ( !buf->clean )
+        {
+            ezdma_buf_sync_for_device( buf, buf->size );
+            buf->clean = 1;
+        }
+
+        sg_dma_address( &sgl[i] ) = buf->dma;
+        sg_dma_len( &sgl[i] ) = buf->size;
+        buf->chain_next = (i + 1 < n) ? chain[i+1] : NULL;
+    }
+
+    txn_desc = dmaengine_prep_slave_sg( p_info->chan, sgl, n, DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT );
+
+    if ( !txn_desc )
+        return -ENOMEM;
+
+    ezdma_set_callback( txn_desc, chain[0], ezdma_stream_rx_done );
+
+    for ( i = 0; i < n; i++ )
+        chain[i]->owner = EZDMA_BUF_HW;
+
+    if ( dma_submit_error( dmaengine_submit( txn_desc ) ) )
+    {
+        for ( i = 0; i < n; i++ )
+            chain[i]->owner = EZDMA_BUF_FREE;
+
+        return -EIO;
+    }
+
+    p_info->stream_posted++;
+
+    return 0;
+}
+
+/* Post as many descriptors as the free lists allow.  Every descriptor gets a
+ * buffer of the largest class, so that every packet has a full-size buffer to
+ * land in, plus one of each smaller class that has one free.
+ *
+ * Returns the number of descriptors posted.
+ *
+ * should be called with p_info->pool.lock held.  Caller issues pending.
+ */
+static unsigned int ezdma_stream_refill( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+    struct list_head * const largest = &pool->classes[ pool->num_classes - 1 ].free;
+    unsigned int posted = 0;
+
+    while ( !list_empty( largest ) )
+    {
+        struct ezdma_buf * chain[EZDMA_POOL_MAX_CLASSES];
+        unsigned int n = 0;
+        unsigned int c;
+
+        for ( c = 0; c < pool->num_classes; c++ )
+        {
+            struct ezdma_buf * const buf = list_first_entry_or_null(
+                    &pool->classes[c].free, struct ezdma_buf, node );
+
+            if ( buf )
+            {
+                list_del( &buf->node );
+                chain[n++] = buf;
+            }
+        }
+
+        if ( ezdma_stream_post( p_info, chain, n ) )
+        {
+            // leave them for the next completion or requeue to retry
+            while ( n-- )
+                list_add( &chain[n]->node, &pool->classes[ chain[n]->cls ].free );
+            break;
+        }
+
+        posted++;
+    }
+
+    return posted;
+}
+
+// should be called with p_info->sem held
+static void ezdma_stream_stop( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+    unsigned int i;
+
+    if ( !p_info->streaming )
+        return;
+
+    atomic_set( &p_info->stream_running, 0 );
+    smp_mb();
+
+    ezdma_terminate( p_info );
+
+    // anything the driver still held goes back to userspace, unfilled
+    spin_lock_irq( &pool->lock );
+
+    for ( i = 0; i < pool->num_classes; i++ )
+        INIT_LIST_HEAD( &pool->classes[i].free );
+
+    for ( i = 0; i < pool->count; i++ )
+    {
+        struct ezdma_buf * const buf = &pool->bufs[i];
+
+        if ( EZDMA_BUF_USER == buf->owner )
+            continue;
+
+        if ( EZDMA_BUF_HW == buf->owner )
+            ezdma_buf_sync_for_cpu( buf, buf->size );
+
+        buf->owner = EZDMA_BUF_USER;
+        buf->chain_next = NULL;
+        buf->clean = 0;
+    }
+
+    p_info->stream_posted = 0;
+    p_info->overrun_flag = false;
+
+    // a capture in progress is abandoned, but stays armed
+    INIT_LIST_HEAD( &p_info->capture_hist );
+    p_info->capture_held = 0;
+    p_info->capture_collected = 0;
+    p_info->capture_trigger = false;
+    p_info->capture_triggered = false;
+
+    spin_unlock_irq( &pool->lock );
+
+    p_info->streaming = 0;
+}
+
+// should be called with p_info->sem held
+static int ezdma_stream_start( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+    unsigned int i;
+    unsigned int posted;
+
+    if ( EZDMA_DEV_TO_CPU != p_info->dir || !p_info->group )
+        return -EINVAL;
+
+    if ( p_info->streaming || p_info->fwd_peer || !check_not_in_flight( p_info ) )
+        return -EBUSY;
+
+    // spilling across classes only works if we're told where the packet ended
+    if ( pool->num_classes > 1 )
+    {
+        struct dma_slave_caps caps;
+
+        if ( dma_get_slave_caps( p_info->chan, &caps ) ||
+             DMA_RESIDUE_GRANULARITY_DESCRIPTOR == caps.residue_granularity )
+        {
+            printk( KERN_WARNING KBUILD_MODNAME ": %s: engine can't report packet lengths, "
+                    "multi-class pools can't be streamed\n", p_info->name );
+            return -EOPNOTSUPP;
+        }
+    }
+
+    p_info->streaming = 1;
+    atomic_set( &p_info->stream_running, 1 );
+
+    spin_lock_irq( &pool->lock );
+
+    for ( i = 0; i < pool->count; i++ )
+    {
+        struct ezdma_buf * const buf = &pool->bufs[i];
+
+        buf->owner = EZDMA_BUF_FREE;
+        buf->clean = 0;
+        list_add_tail( &buf->node, &pool->classes[ buf->cls ].free );
+    }
+
+    posted = ezdma_stream_refill( p_info );
+
+    spin_unlock_irq( &pool->lock );
+
+    if ( !posted )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: couldn't post any stream buffers\n", p_info->name );
+        ezdma_stream_stop( p_info );
+        return -ENOMEM;
+    }
+
+    dma_async_issue_pending( p_info->chan );
+
+    return 0;
+}
+
+// should be called with p_info->sem held.  Caller issues pending.
+static int ezdma_stream_requeue( struct ezdma_drvdata * p_info, __u32 idx )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+    struct ezdma_buf * buf;
+
+    if ( idx >= pool->count )
+        return -EINVAL;
+
+    // Buffers handed back after streaming stopped just stay with userspace.
+    if ( !p_info->streaming )
+        return 0;
+
+    buf = &pool->bufs[idx];
+
+    spin_lock_irq( &pool->lock );
+
+    if ( EZDMA_BUF_USER == buf->owner )
+    {
+        buf->owner = EZDMA_BUF_FREE;
+        list_add_tail( &buf->node, &pool->classes[ buf->cls ].free );
+
+        // stays stopped after an overrun under EZDMA_OVERRUN_STOP
+        if ( atomic_read( &p_info->stream_running ) )
+            ezdma_stream_refill( p_info );
+    }
+
+    spin_unlock_irq( &pool->lock );
+
+    return 0;
+}
+
+/*
+ * Queued TX.
+ *
+ * Submitted pool buffers wait on a per-priority software queue and are only
+ * issued to the engine while fewer than tx_queue_depth descriptors are
+ * outstanding.  Normal-priority buffers may only take tx_bulk_depth of those
+ * slots, so a high-priority buffer only ever waits for what's already been
+ * issued, never for the bulk queue behind it.
+ */
+
+static void ezdma_tx_pump( struct ezdma_drvdata * p_info );
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_tx_done( void * data, const struct dmaengine_result * result )
+{
+    struct ezdma_buf * const buf = (struct ezdma_buf*)data;
+    struct ezdma_drvdata * const p_info = buf->p_info;
+    struct ezdma_completion compl = {
+        .chan   = p_info->group_idx,
+        .buf    = buf->idx,
+        .len    = buf->len,
+    };
+    unsigned long iflags;
+
+    if ( !atomic_read( &p_info->tx_running ) )
+        return;
+
+    if ( DMA_TRANS_NOERROR != result->result )
+        compl.flags |= EZDMA_COMPL_ERROR;
+    else
+    {
+        atomic_inc( &p_info->packets_sent );
+
+        if ( buf->crc_valid )
+        {
+            compl.crc = buf->crc;
+            compl.flags |= EZDMA_COMPL_CRC;
+        }
+    }
+
+    spin_lock_irqsave( &p_info->pool.lock, iflags );
+
+    p_info->tx_inflight--;
+    if ( EZDMA_PRIO_NORMAL == buf->prio )
+        p_info->tx_bulk_inflight--;
+
+    list_del( &buf->node );
+    buf->owner = EZDMA_BUF_USER;
+    buf->deadline = 0;
+    compl.seq = p_info->compl_seq++;
+
+    ezdma_tx_pump( p_info );
+
+    spin_unlock_irqrestore( &p_info->pool.lock, iflags );
+
+    dma_async_issue_pending( p_info->chan );
+
+    // buf is the user's again, and may already be resubmitted with another len
+    atomic64_sub( compl.len, &p_info->tx_outstanding );
+    wake_up( &p_info->limits_wq );
+
+    ezdma_group_push( p_info->group, &compl );
+}
+
+static int ezdma_tx_post( struct ezdma_buf * buf )
+{
+    struct ezdma_drvdata * const p_info = buf->p_info;
+    struct dma_async_tx_descriptor * txn_desc;
+
+    txn_desc = dmaengine_prep_slave_single( p_info->chan, buf->dma, buf->len,
+            DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT );
+
+    if ( !txn_desc )
+        return -ENOMEM;
+
+    ezdma_set_callback( txn_desc, buf, ezdma_tx_done );
+
+    if ( dma_submit_error( dmaengine_submit( txn_desc ) ) )
+        return -EIO;
+
+    buf->owner = EZDMA_BUF_HW;
+
+    return 0;
+}
+
+// should be called with p_info->pool.lock held.  Caller issues pending.
+static void ezdma_tx_pump( struct ezdma_drvdata * p_info )
+{
+    while ( !p_info->tx_paused && p_info->tx_inflight < p_info->tx_queue_depth )
+    {
+        struct ezdma_buf * buf;
+
+        buf = list_first_entry_or_null( &p_info->txq[EZDMA_PRIO_HIGH], struct ezdma_buf, node );
+
+        if ( !buf && p_info->tx_bulk_inflight < p_info->tx_bulk_depth )
+            buf = list_first_entry_or_null( &p_info->txq[EZDMA_PRIO_NORMAL], struct ezdma_buf, node );
+
+        if ( !buf )
+            break;
+
+        if ( ezdma_tx_post( buf ) )
+            break;  // leave it queued, retry on the next completion
+
+        list_move_tail( &buf->node, &p_info->tx_issued );
+
+        p_info->tx_inflight++;
+        if ( EZDMA_PRIO_NORMAL == buf->prio )
+            p_info->tx_bulk_inflight++;
+    }
+}
+
+// should be called with p_info->pool.lock held
+static void ezdma_tx_arm_watchdog( struct ezdma_drvdata * p_info, unsigned long deadline )
+{
+    if ( p_info->tx_next_deadline && !time_before( deadline, p_info->tx_next_deadline ) )
+        return;
+
+    p_info->tx_next_deadline = deadline;
+    mod_delayed_work( system_wq, &p_info->tx_watchdog,
+            time_after( deadline, jiffies ) ? deadline - jiffies : 0 );
+}
+
+// Reports a buffer which missed its deadline and takes it off whichever list
+// it's on.  should be called with p_info->pool.lock held
+static void ezdma_tx_timed_out( struct ezdma_drvdata * p_info, struct ezdma_buf * buf )
+{
+    struct ezdma_completion compl = {
+        .chan   = p_info->group_idx,
+        .buf    = buf->idx,
+        .flags  = EZDMA_COMPL_TIMEDOUT,
+        .seq    = p_info->compl_seq++,
+    };
+
+    list_del( &buf->node );
+    buf->owner = EZDMA_BUF_USER;
+    buf->deadline = 0;
+
+    atomic64_sub( buf->len, &p_info->tx_outstanding );
+
+    ezdma_group_push( p_info->group, &compl );
+}
+
+static inline bool ezdma_tx_expired( const struct ezdma_buf * buf, unsigned long now )
+{
+    return buf->deadline && !time_before( now, buf->deadline );
+}
+
+/* Fails the TX buffers whose deadline has passed.  Expired buffers still
+ * waiting in a queue are simply dropped from it.  If one has been issued, the
+ * engine is presumed stuck: everything issued is cancelled, and the buffers
+ * which hadn't expired go back to the head of their queue, in order, to be
+ * issued again.
+ */
+static void ezdma_tx_watchdog( struct work_struct * work )
+{
+    struct ezdma_drvdata * p_info = container_of( to_delayed_work( work ), struct ezdma_drvdata, tx_watchdog );
+    struct ezdma_pool * const pool = &p_info->pool;
+    struct ezdma_buf * buf;
+    struct ezdma_buf * tmp;
+    unsigned long now;
+    bool stuck = false;
+    unsigned int i;
+
+    // whoever holds the sem may be stopping TX, so don't wait on it
+    if ( down_trylock( &p_info->sem ) )
+    {
+        schedule_delayed_work( &p_info->tx_watchdog, 1 );
+        return;
+    }
+
+    if ( !atomic_read( &p_info->tx_running ) )
+        goto out;
+
+    now = jiffies;
+
+    spin_lock_irq( &pool->lock );
+
+    for ( i = 0; i < EZDMA_NUM_PRIOS; i++ )
+    {
+        list_for_each_entry_safe( buf, tmp, &p_info->txq[i], node )
+        {
+            if ( ezdma_tx_expired( buf, now ) )
+                ezdma_tx_timed_out( p_info, buf );
+        }
+    }
+
+    list_for_each_entry( buf, &p_info->tx_issued, node )
+    {
+        if ( ezdma_tx_expired( buf, now ) )
+            stuck = true;
+    }
+
+    p_info->tx_paused = stuck;
+
+    spin_unlock_irq( &pool->lock );
+
+    if ( stuck )
+    {
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: TX missed its deadline, resetting channel\n",
+                p_info->name );
+
+        // completions may still run until this returns, but nothing new is issued
+        ezdma_terminate( p_info );
+
+        spin_lock_irq( &pool->lock );
+
+        list_for_each_entry_safe_reverse( buf, tmp, &p_info->tx_issued, node )
+        {
+            if ( ezdma_tx_expired( buf, now ) )
+            {
+                ezdma_tx_timed_out( p_info, buf );
+            }
+            else
+            {
+                buf->owner = EZDMA_BUF_QUEUED;
+                list_move( &buf->node, &p_info->txq[ buf->prio ] );
+            }
+        }
+
+        p_info->tx_inflight = 0;
+        p_info->tx_bulk_inflight = 0;
+        p_info->tx_paused = false;
+
+        ezdma_tx_pump( p_info );
+
+        spin_unlock_irq( &pool->lock );
+
+        dma_async_issue_pending( p_info->chan );
+    }
+
+    // rearm for the earliest deadline left
+    spin_lock_irq( &pool->lock );
+
+    p_info->tx_next_deadline = 0;
+
+    for ( i = 0; i < pool->count; i++ )
+    {
+        buf = &pool->bufs[i];
+
+        if ( buf->deadline && (EZDMA_BUF_QUEUED == buf->owner || EZDMA_BUF_HW == buf->owner) )
+            ezdma_tx_arm_watchdog( p_info, buf->deadline );
+    }
+
+    spin_unlock_irq( &pool->lock );
+
+    wake_up( &p_info->limits_wq );
+
+    out:
+    up( &p_info->sem );
+}
+
+// Refuses a submit which can't go as things stand.
+// should be called with p_info->sem held
+static int ezdma_tx_check( struct ezdma_drvdata * p_info, const struct ezdma_submit * req )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+
+    if ( EZDMA_CPU_TO_DEV != p_info->dir || !p_info->group || p_info->fwd_peer )
+        return -EINVAL;
+
+    // a write() or trigger waiting drops the sem, and its timeout terminates the channel
+    if ( !check_idle( p_info ) )
+        return -EBUSY;
+
+    if ( req->buf >= pool->count )
+        return -EINVAL;
+
+    if ( 0 == req->len || req->len > pool->bufs[ req->buf ].size )
+        return -EINVAL;
+
+    // only a hint, the buffer is claimed under pool.lock
+    if ( EZDMA_BUF_USER != READ_ONCE( pool->bufs[ req->buf ].owner ) )
+        return -EBUSY;
+
+    return 0;
+}
+
+// should be called with p_info->sem held
+static int ezdma_tx_submit( struct ezdma_drvdata * p_info, const struct ezdma_submit * req )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+    struct ezdma_buf * buf;
+    unsigned long timeout;
+    bool busy;
+    int rv;
+
+    if ( (rv = ezdma_tx_check( p_info, req )) )
+        return rv;
+
+    buf = &pool->bufs[ req->buf ];
+
+    // tx_done hands buffers back under the lock, so claim it under it too
+    spin_lock_irq( &pool->lock );
+
+    busy = EZDMA_BUF_USER != buf->owner;
+    if ( !busy )
+        buf->owner = EZDMA_BUF_QUEUED;
+
+    spin_unlock_irq( &pool->lock );
+
+    if ( busy )
+        return -EBUSY;
+
+    buf->len = req->len;
+    buf->prio = (req->flags & EZDMA_SUBMIT_HIGH_PRIO) ? EZDMA_PRIO_HIGH : EZDMA_PRIO_NORMAL;
+
+    timeout = req->timeout_ms ? msecs_to_jiffies( req->timeout_ms ) : p_info->timeout;
+    buf->deadline = timeout ? (jiffies + timeout) | 1 : 0;  // 0 means no deadline
+
+    // before the sync, which may evict what the CPU just wrote from the cache
+    buf->crc_valid = READ_ONCE( p_info->crc );
+    if ( buf->crc_valid )
+        buf->crc = ~crc32c( ~0, buf->vaddr, buf->len );
+
+    ezdma_buf_sync_for_device( buf, buf->len );
+
+    atomic_set( &p_info->tx_running, 1 );
+
+    atomic64_add( buf->len, &p_info->tx_outstanding );
+
+    spin_lock_irq( &pool->lock );
+
+    list_add_tail( &buf->node, &p_info->txq[ buf->prio ] );
+
+    if ( buf->deadline )
+        ezdma_tx_arm_watchdog( p_info, buf->deadline );
+
+    ezdma_tx_pump( p_info );
+
+    spin_unlock_irq( &pool->lock );
+
+    dma_async_issue_pending( p_info->chan );
+
+    return 0;
+}
+
+/* Waits until nothing submitted with EZDMA_IOC_SUBMIT is outstanding,
+ * for at most timeout jiffies (0 to wait forever).  Only a fatal signal
+ * interrupts it unless interruptible.
+ *
+ * should NOT be called with p_info->sem held -- submitting carries on
+ */
+static long ezdma_tx_drain( struct ezdma_drvdata * p_info, unsigned long timeout, bool interruptible )
+{
+    const long t = timeout ? (long)timeout : MAX_SCHEDULE_TIMEOUT;
+    long rv;
+
+    if ( interruptible )
+        rv = wait_event_interruptible_timeout( p_info->limits_wq,
+                0 == atomic64_read( &p_info->tx_outstanding ), t );
+    else
+        rv = wait_event_killable_timeout( p_info->limits_wq,
+                0 == atomic64_read( &p_info->tx_outstanding ), t );
+
+    if ( rv < 0 )
+        return rv;
+
+    return rv ? 0 : -ETIMEDOUT;
+}
+
+// should be called with p_info->sem held
+static void ezdma_tx_stop( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_pool * const pool = &p_info->pool;
+    unsigned int i;
+
+    if ( !atomic_read( &p_info->tx_running ) )
+        return;
+
+    atomic_set( &p_info->tx_running, 0 );
+    smp_mb();
+
+    ezdma_terminate( p_info );
+
+    // whatever was queued or in flight is abandoned
+    spin_lock_irq( &pool->lock );
+
+    for ( i = 0; i < EZDMA_NUM_PRIOS; i++ )
+        INIT_LIST_HEAD( &p_info->txq[i] );
+    INIT_LIST_HEAD( &p_info->tx_issued );
+
+    p_info->tx_inflight = 0;
+    p_info->tx_bulk_inflight = 0;
+    p_info->tx_paused = false;
+    p_info->tx_next_deadline = 0;
+    cancel_delayed_work( &p_info->tx_watchdog );    // if it's running, it'll find TX stopped
+
+    for ( i = 0; i < pool->count; i++ )
+    {
+        struct ezdma_buf * const buf = &pool->bufs[i];
+
+        if ( EZDMA_BUF_QUEUED == buf->owner || EZDMA_BUF_HW == buf->owner )
+            atomic64_sub( buf->len, &p_info->tx_outstanding );
+
+        buf->owner = EZDMA_BUF_USER;
+        buf->deadline = 0;
+    }
+
+    spin_unlock_irq( &pool->lock );
+
+    wake_up( &p_info->limits_wq );
+}
+
+/*
+ * Prepared transfers.
+ *
+ * A transfer of a pool buffer which is set up once and then triggered over
+ * and over.  If the engine supports descriptor reuse, the descriptor is
+ * prepared once and resubmitted as is; otherwise it's prepared on every
+ * trigger, which still skips all the pinning and mapping of write().
+ */
+
+// should be called with p_info->sem held
+static struct dma_async_tx_descriptor * ezdma_prep_buf_desc( struct ezdma_drvdata * p_info )
+{
+    struct dma_async_tx_descriptor * txn_desc;
+
+    txn_desc = dmaengine_prep_slave_single( p_info->chan, p_info->prep_buf->dma, p_info->prep_len,
+                                            ezdma_xfer_dir( p_info ), DMA_PREP_INTERRUPT );
+
+    if ( txn_desc )
+    {
+        txn_desc->callback = ezdma_dmaengine_callback_func;
+        txn_desc->callback_param = p_info;
+    }
+
+    return txn_desc;
+}
+
+// should be called with p_info->sem held, and nothing in flight
+static void ezdma_prepared_drop( struct ezdma_drvdata * p_info )
+{
+    if ( p_info->prep_desc )
+        dmaengine_desc_free( p_info->prep_desc );
+
+    p_info->prep_desc = NULL;
+    p_info->prep_buf = NULL;
+    p_info->prep_len = 0;
+}
+
+// should be called with p_info->sem held
+static int ezdma_prepare( struct ezdma_drvdata * p_info, const struct ezdma_prepare * req )
+{
+    struct dma_slave_caps caps;
+    struct dma_async_tx_descriptor * txn_desc;
+    int rv;
+
+    if ( !check_not_in_flight( p_info ) )
+        return -EBUSY;
+
+    // no trigger could use it, and nothing else may be on the channel (see below)
+    if ( p_info->fwd_peer || p_info->streaming || atomic_read( &p_info->tx_running ) )
+        return -EBUSY;
+
+    ezdma_prepared_drop( p_info );
+
+    if ( 0 == req->len )
+        return 0;
+
+    if ( req->buf >= p_info->pool.count || req->len > p_info->pool.bufs[ req->buf ].size )
+        return -EINVAL;
+
+    p_info->prep_buf = &p_info->pool.bufs[ req->buf ];
+    p_info->prep_len = req->len;
+
+    // a descriptor that can't be reused can't be freed unsubmitted either
+    if ( dma_get_slave_caps( p_info->chan, &caps ) || !caps.descriptor_reuse )
+        return 0;
+
+    txn_desc = ezdma_prep_buf_desc( p_info );
+
+    if ( !txn_desc )
+    {
+        ezdma_prepared_drop( p_info );
+        return -ENOMEM;
+    }
+
+    if ( (rv = dmaengine_desc_set_reuse( txn_desc )) )
+    {
+        /* Caps said it would work.  A descriptor that isn't reusable can only
+         * be let go of by submitting it and terminating the channel, which
+         * has nothing else on it. */
+        printk( KERN_WARNING KBUILD_MODNAME ": %s: descriptor reuse refused: %d\n", p_info->name, rv );
+        dmaengine_submit( txn_desc );
+        ezdma_terminate( p_info );
+        ezdma_prepared_drop( p_info );
+        return rv;
+    }
+
+    p_info->prep_desc = txn_desc;
+
+    return 0;
+}
+
+// should be called with p_info->sem held
+static int ezdma_trigger( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_buf * const buf = p_info->prep_buf;
+    const size_t len = p_info->prep_len;
+    struct dma_async_tx_descriptor * txn_desc;
+    dma_cookie_t cookie;
+    bool busy;
+    int rv;
+
+    if ( !buf )
+        return -EINVAL;
+
+    if ( p_info->fwd_peer || p_info->streaming )
+        return -EBUSY;  // channel's buffers are driven from the completion path
+
+    if ( atomic_read( &p_info->tx_running ) )
+        return -EBUSY;  // a timeout would terminate the queued TX along with it
+
+    // keep it from being submitted behind our back while it's on the engine
+    spin_lock_irq( &p_info->pool.lock );
+
+    busy = EZDMA_BUF_USER != buf->owner;
+    if ( !busy )
+        buf->owner = EZDMA_BUF_HW;
+
+    spin_unlock_irq( &p_info->pool.lock );
+
+    if ( busy )
+        return -EBUSY;
+
+    txn_desc = p_info->prep_desc ? p_info->prep_desc : ezdma_prep_buf_desc( p_info );
+
+    if ( !txn_desc )
+    {
+        rv = -ENOMEM;
+        goto out;
+    }
+
+    ezdma_buf_sync_for_device( buf, len );
+
+    raw_spin_lock_irq( &p_info->state_lock );
+
+    p_info->state = DMA_IN_FLIGHT;
+    p_info->submit_cpu = smp_processor_id();
+
+    raw_spin_unlock_irq( &p_info->state_lock );
+
+    cookie = dmaengine_submit( txn_desc );
+
+    if ( cookie < DMA_MIN_COOKIE )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: dmaengine_submit() returned %d\n", p_info->name, cookie);
+        rv = cookie;
+    }
+    else
+    {
+        dma_async_issue_pending( p_info->chan );
+
+        rv = ezdma_wait_for_dma( p_info );
+    }
+
+    raw_spin_lock_irq( &p_info->state_lock );
+    if ( p_info->state != DMA_IN_FLIGHT && cookie >= DMA_MIN_COOKIE )
+        rv = 0;     // finished, even if the wait was cut short
+    p_info->state = DMA_IDLE;
+    raw_spin_unlock_irq( &p_info->state_lock );
+
+    if ( p_info->gone )
+        wake_up( &p_info->wq );
+
+    ezdma_buf_sync_for_cpu( buf, len );
+
+    if ( 0 == rv )
+        atomic_inc( EZDMA_DEV_TO_CPU == p_info->dir ? &p_info->packets_rcvd : &p_info->packets_sent );
+
+    out:
+    spin_lock_irq( &p_info->pool.lock );
+    buf->owner = EZDMA_BUF_USER;
+    spin_unlock_irq( &p_info->pool.lock );
+
+    return rv;
+}
+
+// drop the first num_members members of the group
+static void ezdma_group_detach( struct ezdma_group * group, unsigned int num_members )
+{
+    unsigned int i;
+
+    for ( i = 0; i < num_members; i++ )
+    {
+        struct ezdma_drvdata * const p_info = group->members[i];
+
+        // give queued TX its chance first, if the channel asked for one
+        if ( EZDMA_CLOSE_DRAIN == READ_ONCE( p_info->close_policy ) )
+            ezdma_tx_drain( p_info, READ_ONCE( p_info->close_timeout ), false );
+
+        down( &p_info->sem );
+        ezdma_stream_stop( p_info );
+        ezdma_tx_stop( p_info );
+        p_info->group = NULL;
+        up( &p_info->sem );
+
+        fput( group->files[i] );
+    }
+}
+
+static ssize_t ezdma_group_read(struct file *filp, char __user *userbuf, size_t count, loff_t *f_pos)
+{
+    struct ezdma_group * group = (struct ezdma_group*)filp->private_data;
+    const size_t max_records = count / sizeof(struct ezdma_completion);
+    size_t done = 0;
+    ssize_t rv = 0;
+
+    if ( 0 == max_records )
+        return -EINVAL;
+
+    // another reader may empty the ring before we get to it, so wait again then
+    while ( 0 == done && 0 == rv )
+    {
+        if ( filp->f_flags & O_NONBLOCK )
+        {
+            if ( kfifo_is_empty( &group->ring ) )
+                return -EAGAIN;
+        }
+        else if ( wait_event_interruptible( group->wq, !kfifo_is_empty( &group->ring ) ) )
+        {
+            return -ERESTARTSYS;
+        }
+
+        if ( mutex_lock_interruptible( &group->batch_lock ) )
+            return -ERESTARTSYS;
+
+        while ( done < max_records )
+        {
+            unsigned int n;
+
+            spin_lock_irq( &group->lock );
+            n = kfifo_out( &group->ring, group->batch,
+                    min_t(size_t, max_records - done, EZDMA_GROUP_BATCH) );
+            spin_unlock_irq( &group->lock );
+
+            if ( 0 == n )
+                break;
+
+            if ( copy_to_user( userbuf + done * sizeof(struct ezdma_completion),
+                        group->batch, n * sizeof(struct ezdma_completion) ) )
+            {
+                rv = -EFAULT;   // records are lost, but so is the caller
+                break;
+            }
+
+            done += n;
+        }
+
+        mutex_unlock( &group->batch_lock );
+    }
+
+    return done ? done * sizeof(struct ezdma_completion) : rv;
+}
+
+static ssize_t ezdma_group_write(struct file *filp, const char __user *userbuf, size_t count, loff_t *f_pos)
+{
+    struct ezdma_group * group = (struct ezdma_group*)filp->private_data;
+    const size_t num_records = count / sizeof(struct ezdma_completion);
+    unsigned long touched = 0;  // members that need an issue_pending
+    size_t done = 0;
+    ssize_t rv = 0;
+    unsigned int i;
+
+    if ( 0 == num_records || 0 != (count % sizeof(struct ezdma_completion)) )
+        return -EINVAL;
+
+    if ( mutex_lock_interruptible( &group->batch_lock ) )
+        return -ERESTARTSYS;
+
+    while ( done < num_records && !rv )
+    {
+        const unsigned int n = min_t(size_t, num_records - done, EZDMA_GROUP_BATCH);
+        unsigned int j;
+
+        if ( copy_from_user( group->batch, userbuf + done * sizeof(struct ezdma_completion),
+                    n * sizeof(struct ezdma_completion) ) )
+        {
+            rv = -EFAULT;
+            break;
+        }
+
+        for ( j = 0; j < n; j++ )
+        {
+            const struct ezdma_completion * const compl = &group->batch[j];
+            struct ezdma_drvdata * p_info;
+
+            if ( compl->chan >= group->count )
+            {
+                rv = -EINVAL;
+                break;
+            }
+
+            p_info = group->members[ compl->chan ];
+
+            down( &p_info->sem );
+            rv = ezdma_stream_requeue( p_info, compl->buf );
+            up( &p_info->sem );
+
+            if ( rv )
+                break;
+
+            touched |= 1UL << compl->chan;
+            done++;
+        }
+    }
+
+    mutex_unlock( &group->batch_lock );
+
+    for ( i = 0; i < group->count; i++ )
+    {
+        struct ezdma_drvdata * const p_info = group->members[i];
+
+        if ( !(touched & (1UL << i)) )
+            continue;
+
+        // a member's node may have been removed since its buffers were requeued
+        down( &p_info->sem );
+        if ( p_info->chan )
+            dma_async_issue_pending( p_info->chan );
+        up( &p_info->sem );
+    }
+
+    return done ? done * sizeof(struct ezdma_completion) : rv;
+}
+
+static __poll_t ezdma_group_poll(struct file *filp, poll_table *wait)
+{
+    struct ezdma_group * group = (struct ezdma_group*)filp->private_data;
+
+    poll_wait( filp, &group->wq, wait );
+
+    if ( kfifo_is_empty( &group->ring ) )
+        return EPOLLOUT | EPOLLWRNORM;
+
+    return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+}
+
+static int ezdma_group_release(struct inode *inode, struct file *filp)
+{
+    struct ezdma_group * group = (struct ezdma_group*)filp->private_data;
+
+    ezdma_group_detach( group, group->count );
+    kfifo_free( &group->ring );
+    kfree( group );
+
+    return 0;
+}
+
+static const struct file_operations ezdma_group_fops = {
+    .owner      = THIS_MODULE,
+    .read       = ezdma_group_read,
+    .write      = ezdma_group_write,
+    .poll       = ezdma_group_poll,
+    .release    = ezdma_group_release,
+    .llseek     = noop_llseek,
+};
+
+static int ezdma_group_create( const struct ezdma_group_req __user * argp )
+{
+    struct ezdma_group_req req;
+    struct ezdma_group * group;
+    unsigned int ring_entries = 0;
+    unsigned int i;
+    int rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    if ( 0 == req.count || req.count > EZDMA_GROUP_MAX_CHANNELS )
+        return -EINVAL;
+
+    if ( NULL == (group = kzalloc( sizeof(*group), GFP_KERNEL )) )
+        return -ENOMEM;
+
+    spin_lock_init( &group->lock );
+    init_waitqueue_head( &group->wq );
+    mutex_init( &group->batch_lock );
+
+    for ( i = 0; i < req.count; i++ )
+    {
+        struct file * const filp = fget( req.fds[i] );
+        struct ezdma_drvdata * p_info;
+
+        if ( !filp )
+        {
+            rv = -EBADF;
+            goto err_detach;
+        }
+
+        if ( filp->f_op != &ezdma_fops )
+        {
+            fput( filp );
+            rv = -EINVAL;
+            goto err_detach;
+        }
+
+        p_info = (struct ezdma_drvdata*)filp->private_data;
+
+        down( &p_info->sem );
+
+        if ( p_info->gone || p_info->group || 0 == p_info->pool.count )
+        {
+            rv = p_info->gone ? -ENODEV : (p_info->group ? -EBUSY : -EINVAL);
+            up( &p_info->sem );
+            fput( filp );
+            goto err_detach;
+        }
+
+        // membership pins the pool size, so the ring can't overflow
+        p_info->group = group;
+        p_info->group_idx = i;
+        ring_entries += p_info->pool.count;
+
+        up( &p_info->sem );
+
+        group->members[i] = p_info;
+        group->files[i] = filp;
+        group->count++;
+    }
+
+    if ( (rv = kfifo_alloc( &group->ring, ring_entries, GFP_KERNEL )) )
+        goto err_detach;
+
+    rv = anon_inode_getfd( "[ezdma-group]", &ezdma_group_fops, group, O_RDWR | O_CLOEXEC );
+
+    if ( rv < 0 )
+    {
+        kfifo_free( &group->ring );
+        goto err_detach;
+    }
+
+    return rv;
+
+    err_detach:
+    ezdma_group_detach( group, group->count );
+    kfree( group );
+
+    return rv;
+}
+
+static long ezdma_ioctl_submit( struct file * filp, const struct ezdma_submit __user * argp )
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)filp->private_data;
+    struct ezdma_submit req;
+    long rv;
+
+    if ( copy_from_user( &req, argp, sizeof(req) ) )
+        return -EFAULT;
+
+    // don't take tokens for a submit that's refused anyway
+    if ( down_interruptible( &p_info->sem ) )
+        return -ERESTARTSYS;
+
+    rv = atomic_read( &p_info->accepting ) ? ezdma_tx_check( p_info, &req ) : -EBADF;
+
+    up( &p_info->sem );
+
+    if ( rv )
+        return rv;
+
+    rv = ezdma_limits_wait( p_info, req.len, 1, filp->f_flags & O_NONBLOCK );
+    if ( rv )
+        return rv;
+
+    if ( down_interruptible( &p_info->sem ) )
+    {
+        ezdma_limits_refund( p_info, req.len );
+        return -ERESTARTSYS;
+    }
+
+    if ( !atomic_read( &p_info->accepting ) )
+        rv = -EBADF;
+    else
+        rv = ezdma_tx_submit( p_info, &req );
+
+    up( &p_info->sem );
+
+    // things can change while it waits, e.g. the buffer submitted from another thread
+    if ( rv )
+        ezdma_limits_refund( p_info, req.len );
+
+    return rv;
+}
+
+static long ezdma_ioctl_drain( struct file * filp, const __u32 __user * argp )
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)filp->private_data;
+    __u32 timeout_ms;
+
+    if ( get_user( timeout_ms, argp ) )
+        return -EFAULT;
+
+    if ( EZDMA_CPU_TO_DEV != p_info->dir )
+        return -EINVAL;
+
+    return ezdma_tx_drain( p_info, timeout_ms ? msecs_to_jiffies( timeout_ms ) : READ_ONCE( p_info->timeout ), true );
+}
+
+static long ezdma_ioctl_trigger( struct file * filp )
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)filp->private_data;
+    long rv;
+
+    rv = ezdma_limits_wait( p_info, READ_ONCE( p_info->prep_len ), 0, filp->f_flags & O_NONBLOCK );
+    if ( rv )
+        return rv;
+
+    if ( down_interruptible( &p_info->sem ) )
+        return -ERESTARTSYS;
+
+    if ( !atomic_read( &p_info->accepting ) )
+        rv = -EBADF;
+    else
+        rv = ezdma_trigger( p_info );
+
+    up( &p_info->sem );
+
+    return rv;
+}
+
+static long ezdma_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)filp->private_data;
+    void __user * argp = (void __user *)arg;
+    long rv;
+
+    // takes the sem of every member itself
+    if ( EZDMA_IOC_GROUP_CREATE == cmd )
+        return ezdma_group_create( (const struct ezdma_group_req __user *)argp );
+
+    // may sleep on the rate limits or for completions, which mustn't hold up the completion path
+    if ( EZDMA_IOC_SUBMIT == cmd )
+        return ezdma_ioctl_submit( filp, (const struct ezdma_submit __user *)argp );
+    if ( EZDMA_IOC_TRIGGER == cmd )
+        return ezdma_ioctl_trigger( filp );
+    if ( EZDMA_IOC_DRAIN == cmd )
+        return ezdma_ioctl_drain( filp, (const __u32 __user *)argp );
+
+    if ( down_interruptible( &p_info->sem ) )
+        return -ERESTARTSYS;
+
+    if ( !atomic_read( &p_info->accepting ) )
+    {
+        rv = -EBADF;
+        goto out;
+    }
+
+    switch ( cmd )
+    {
+        case EZDMA_IOC_POOL_ALLOC:
+        {
+            struct ezdma_pool_req req;
+            struct ezdma_pool_class cls = { 0 };
+
+            if ( copy_from_user( &req, argp, sizeof(req) ) )
+                rv = -EFAULT;
+            else if ( p_info->group )
+                rv = -EBUSY;
+            else
+            {
+                cls.count = req.count;
+                cls.size = req.size;
+                rv = ezdma_pool_alloc( p_info, &cls, 1, 0 );
+            }
+            break;
+        }
+
+        case EZDMA_IOC_POOL_ALLOC_CLASSES:
+        {
+            struct ezdma_pool_classes_req req;
+
+            if ( copy_from_user( &req, argp, sizeof(req) ) )
+                rv = -EFAULT;
+            else if ( p_info->group )
+                rv = -EBUSY;
+            else if ( 0 == (rv = ezdma_pool_alloc( p_info, req.classes, req.num_classes, req.flags )) &&
+                      copy_to_user( argp, &req, sizeof(req) ) )
+                rv = -EFAULT;
+            break;
+        }
+
+        case EZDMA_IOC_POOL_FREE:
+            if ( p_info->pool_static || p_info->prep_buf || p_info->fwd_peer || p_info->group || atomic_read( &p_info->pool.mmap_count ) )
+            {
+                rv = -EBUSY;
+            }
+            else
+            {
+                ezdma_pool_free( p_info );
+                rv = 0;
+            }
+            break;
+
+        case EZDMA_IOC_FORWARD:
+        {
+            __s32 tx_fd;
+
+            if ( get_user( tx_fd, (__s32 __user *)argp ) )
+                rv = -EFAULT;
+            else if ( tx_fd >= 0 )
+                rv = ezdma_fwd_bind( p_info, tx_fd );
+            else if ( EZDMA_DEV_TO_CPU == p_info->dir && p_info->fwd_peer )
+            {
+                ezdma_fwd_unbind( p_info );
+                rv = 0;
+            }
+            else
+                rv = -EINVAL;
+            break;
+        }
+
+        case EZDMA_IOC_STREAM_START:
+            rv = ezdma_stream_start( p_info );
+            break;
+
+        case EZDMA_IOC_STREAM_STOP:
+            ezdma_stream_stop( p_info );
+            rv = 0;
+            break;
+
+        case EZDMA_IOC_SET_LIMITS:
+        {
+            struct ezdma_limits limits;
+
+            if ( copy_from_user( &limits, argp, sizeof(limits) ) )
+                rv = -EFAULT;
+            else
+                rv = ezdma_limits_set( p_info, &limits );
+            break;
+        }
+
+        case EZDMA_IOC_SET_TIMEOUT:
+        {
+            __u32 timeout_ms;
+
+            if ( get_user( timeout_ms, (__u32 __user *)argp ) )
+                rv = -EFAULT;
+            else
+            {
+                p_info->timeout = msecs_to_jiffies( timeout_ms );
+                rv = 0;
+            }
+            break;
+        }
+
+        case EZDMA_IOC_CAPTURE_ARM:
+        {
+            struct ezdma_capture cap;
+
+            if ( copy_from_user( &cap, argp, sizeof(cap) ) )
+                rv = -EFAULT;
+            else if ( EZDMA_DEV_TO_CPU != p_info->dir || !p_info->group )
+                rv = -EINVAL;
+            else
+            {
+                ezdma_capture_arm( p_info, &cap );
+                rv = 0;
+            }
+            break;
+        }
+
+        case EZDMA_IOC_CAPTURE_TRIGGER:
+        {
+            spin_lock_irq( &p_info->pool.lock );
+
+            if ( !p_info->capture_armed )
+                rv = -EINVAL;
+            else
+            {
+                p_info->capture_trigger = true;
+                rv = 0;
+            }
+
+            spin_unlock_irq( &p_info->pool.lock );
+            break;
+        }
+
+        case EZDMA_IOC_SET_CLOSE:
+        {
+            struct ezdma_close close;
+
+            if ( copy_from_user( &close, argp, sizeof(close) ) )
+                rv = -EFAULT;
+            else if ( EZDMA_CPU_TO_DEV != p_info->dir || close.policy > EZDMA_CLOSE_DRAIN )
+                rv = -EINVAL;
+            else
+            {
+                WRITE_ONCE( p_info->close_timeout, msecs_to_jiffies( close.timeout_ms ) );
+                WRITE_ONCE( p_info->close_policy, close.policy );
+                rv = 0;
+            }
+            break;
+        }
+
+        case EZDMA_IOC_SET_NUMA_NODE:
+        {
+            __s32 node;
+
+            if ( get_user( node, (__s32 __user *)argp ) )
+                rv = -EFAULT;
+            else if ( p_info->pool.count )
+                rv = -EBUSY;    // takes effect on the next pool, so don't misreport this one
+            else if ( node < 0 )
+            {
+                p_info->numa_node = NUMA_NO_NODE;
+                rv = 0;
+            }
+            else if ( node >= nr_node_ids || !node_online( node ) )
+                rv = -EINVAL;
+            else
+            {
+                p_info->numa_node = node;
+                rv = 0;
+            }
+            break;
+        }
+
+        case EZDMA_IOC_PREPARE:
+        {
+            struct ezdma_prepare req;
+
+            if ( copy_from_user( &req, argp, sizeof(req) ) )
+                rv = -EFAULT;
+            else
+                rv = ezdma_prepare( p_info, &req );
+            break;
+        }
+
+        case EZDMA_IOC_SET_OVERRUN:
+        {
+            __u32 policy;
+
+            if ( get_user( policy, (__u32 __user *)argp ) )
+                rv = -EFAULT;
+            else if ( EZDMA_DEV_TO_CPU != p_info->dir || policy > EZDMA_OVERRUN_OVERWRITE )
+                rv = -EINVAL;
+            else
+            {
+                WRITE_ONCE( p_info->overrun_policy, policy );
+                rv = 0;
+            }
+            break;
+        }
+
+        case EZDMA_IOC_SET_FILTER:
+        {
+            struct ezdma_filter filter;
+            unsigned long iflags;
+
+            if ( copy_from_user( &filter, argp, sizeof(filter) ) )
+                rv = -EFAULT;
+            else if ( EZDMA_DEV_TO_CPU != p_info->dir )
+                rv = -EINVAL;
+            else if ( !(rv = ezdma_filter_check( &filter )) )
+            {
+                // takes effect from the next packet, even mid-stream
+                spin_lock_irqsave( &p_info->pool.lock, iflags );
+                p_info->filter = filter;
+                spin_unlock_irqrestore( &p_info->pool.lock, iflags );
+            }
+            break;
+        }
+
+        case EZDMA_IOC_SET_CRC:
+        {
+            __u32 enable;
+
+            if ( get_user( enable, (__u32 __user *)argp ) )
+                rv = -EFAULT;
+            else if ( enable > 1 )
+                rv = -EINVAL;
+            else
+            {
+                WRITE_ONCE( p_info->crc, enable );
+                rv = 0;
+            }
+            break;
+        }
+
+        case EZDMA_IOC_SET_RX_CHUNK:
+        {
+            __u32 chunk_bytes;
+
+            if ( get_user( chunk_bytes, (__u32 __user *)argp ) )
+                rv = -EFAULT;
+            else if ( EZDMA_DEV_TO_CPU != p_info->dir )
+                rv = -EINVAL;
+            else
+            {
+                p_info->rx_chunk_pages = DIV_ROUND_UP( chunk_bytes, PAGE_SIZE );
+                rv = 0;
+            }
+            break;
+        }
+
+        case EZDMA_IOC_GET_LIMITS:
+        {
+            struct ezdma_limits limits;
+
+            spin_lock( &p_info->limits_lock );
+            limits = p_info->limits;
+            spin_unlock( &p_info->limits_lock );
+
+            rv = copy_to_user( argp, &limits, sizeof(limits) ) ? -EFAULT : 0;
+            break;
+        }
+
+        default:
+            rv = -ENOTTY;
+            break;
+    }
+
+    out:
+    up( &p_info->sem );
+
+    return rv;
+}
+
+static int ezdma_release(struct inode *inode, struct file *filp)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)filp->private_data;
+
+    atomic_set( &p_info->accepting, 0 );    // disallow new reads/writes
+
+    down( &p_info->sem );   // can't be restarted, and the reference must be dropped
+
+    if ( EZDMA_DEV_TO_CPU == p_info->dir && p_info->fwd_peer )
+        ezdma_fwd_unbind( p_info );
+
+    ezdma_terminate( p_info );
+    // TODO: wake up any sleeping threads?
+
+    ezdma_prepared_drop( p_info );
+
+    if ( p_info->gone )
+        ezdma_free_removed_pool( p_info );  // if it was still mapped at removal
+    else if ( !p_info->pool_static )
+        ezdma_pool_free( p_info );  // no mappings can remain -- they hold the file
+    if ( !p_info->max_packet )
+        ezdma_inflight_free( p_info );  // else keep the page lists sized at probe
+
+    p_info->in_use = 0;
+
+    up( &p_info->sem );
+
+    kref_put( &p_info->ref, ezdma_drvdata_release );
+
+    return 0;
+}
+
+
+
+
+
+/* sysfs attributes of each channel's device */
+
+static ssize_t packets_sent_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%d\n", atomic_read( &p_info->packets_sent ) );
+}
+static DEVICE_ATTR_RO(packets_sent);
+
+static ssize_t packets_rcvd_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%d\n", atomic_read( &p_info->packets_rcvd ) );
+}
+static DEVICE_ATTR_RO(packets_rcvd);
+
+static ssize_t tx_queue_depth_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%u\n", p_info->tx_queue_depth );
+}
+
+static ssize_t tx_queue_depth_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+    unsigned int val;
+
+    if ( kstrtouint( buf, 0, &val ) || 0 == val )
+        return -EINVAL;
+
+    spin_lock_irq( &p_info->pool.lock );
+
+    p_info->tx_queue_depth = val;
+
+    if ( p_info->tx_bulk_depth > val )
+        p_info->tx_bulk_depth = val;
+
+    ezdma_tx_pump( p_info );
+
+    spin_unlock_irq( &p_info->pool.lock );
+
+    if ( p_info->chan )
+        dma_async_issue_pending( p_info->chan );
+
+    return count;
+}
+static DEVICE_ATTR_RW(tx_queue_depth);
+
+static ssize_t tx_bulk_depth_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%u\n", p_info->tx_bulk_depth );
+}
+
+static ssize_t tx_bulk_depth_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+    unsigned int val;
+    ssize_t rv = count;
+
+    if ( kstrtouint( buf, 0, &val ) || 0 == val )
+        return -EINVAL;
+
+    spin_lock_irq( &p_info->pool.lock );
+
+    if ( val > p_info->tx_queue_depth )
+        rv = -EINVAL;
+    else
+        p_info->tx_bulk_depth = val;
+
+    ezdma_tx_pump( p_info );
+
+    spin_unlock_irq( &p_info->pool.lock );
+
+    if ( p_info->chan )
+        dma_async_issue_pending( p_info->chan );
+
+    return rv;
+}
+static DEVICE_ATTR_RW(tx_bulk_depth);
+
+static ssize_t numa_node_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%d\n", p_info->chan ? ezdma_numa_node( p_info ) : NUMA_NO_NODE );
+}
+static DEVICE_ATTR_RO(numa_node);
+
+static ssize_t completion_cpu_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%d\n", READ_ONCE( p_info->callback_cpu ) );
+}
+static DEVICE_ATTR_RO(completion_cpu);
+
+static ssize_t cross_cpu_completions_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%d\n", atomic_read( &p_info->cross_cpu_completions ) );
+}
+static DEVICE_ATTR_RO(cross_cpu_completions);
+
+static ssize_t overruns_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%d\n", atomic_read( &p_info->overruns ) );
+}
+static DEVICE_ATTR_RO(overruns);
+
+static ssize_t filter_delivered_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%d\n", atomic_read( &p_info->filter_verdicts[ EZDMA_FILTER_DELIVER ] ) );
+}
+static DEVICE_ATTR_RO(filter_delivered);
+
+static ssize_t filter_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+
+    return sprintf( buf, "%d\n", atomic_read( &p_info->filter_verdicts[ EZDMA_FILTER_DROP ] ) );
+}
+static DEVICE_ATTR_RO(filter_dropped);
+
+static ssize_t filter_steered_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
 
-        if ( down_timeout( &p_info->sem, SEM_TAKE_TIMEOUT ) )
-        {
-            printk( KERN_ALERT KBUILD_MODNAME 
-                    ": %s: read sem take stalled for %d seconds -- probably broken\n",
-                    p_info->name, 
-                    SEM_TAKE_TIMEOUT);
-            goto noup_out;
-        }
+    return sprintf( buf, "%d\n", atomic_read( &p_info->filter_verdicts[ EZDMA_FILTER_STEER ] ) );
+}
+static DEVICE_ATTR_RO(filter_steered);
 
-        spin_lock_irq(&p_info->state_lock);
-        if ( p_info->state == DMA_IN_FLIGHT && -ERESTARTSYS == wait_rv )
-        {
-            dmaengine_terminate_all( p_info->chan );
-            rv = wait_rv;
-        }
+static ssize_t filter_triggered_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
 
-        ezdma_unprepare_after_dma( p_info );    // sets us back to DMA_IDLE
-        spin_unlock_irq(&p_info->state_lock);
-    }
+    return sprintf( buf, "%d\n", atomic_read( &p_info->filter_verdicts[ EZDMA_FILTER_TRIGGER ] ) );
+}
+static DEVICE_ATTR_RO(filter_triggered);
 
-    out:
-    up( &p_info->sem );
+static ssize_t captures_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
 
-    noup_out:
-    return rv;
+    return sprintf( buf, "%d\n", atomic_read( &p_info->captures ) );
 }
+static DEVICE_ATTR_RO(captures);
 
-static ssize_t ezdma_write(struct file *filp, const char __user *userbuf, size_t count, loff_t *f_pos)
+static ssize_t steer_completions_show(struct device *dev, struct device_attribute *attr, char *buf)
 {
-    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)filp->private_data;
-    ssize_t rv = count;
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
 
-    // Ensure this is a writable device.
-    if ( EZDMA_CPU_TO_DEV != p_info->dir )
-    {
-        printk( KERN_WARNING KBUILD_MODNAME ": %s: can't write, is an RX device\n", p_info->name);
-        return -EINVAL;
-    }
-    if ( 0 != (count % EZDMA_ALIGN_BYTES) )
-    {
-        printk( KERN_WARNING KBUILD_MODNAME ": %s: unaligned write of %u bytes requested\n", p_info->name, count);
-        return -EINVAL;
-    }
+    return sprintf( buf, "%d\n", READ_ONCE( p_info->steer_completions ) );
+}
 
-    // Ensure this is a writable device.
+static ssize_t steer_completions_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+    bool val;
 
-    if ( down_interruptible( &p_info->sem ) )
-        return -ERESTARTSYS;
+    if ( kstrtobool( buf, &val ) )
+        return -EINVAL;
 
-    if ( !atomic_read(&p_info->accepting ) )
-    {
-        rv = -EBADF;
-        goto out;
-    }
-    else
-    {
-        int prep_rv;
-        int wait_rv;
+    WRITE_ONCE( p_info->steer_completions, val );
 
-        prep_rv = ezdma_prepare_for_dma( p_info, (char __user*)userbuf, count );
+    return count;
+}
+static DEVICE_ATTR_RW(steer_completions);
 
-        if (prep_rv)
-        {
-            rv = prep_rv;
-            goto out;
-        }
+static ssize_t require_contiguous_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
 
-        up( &p_info->sem );
+    return sprintf( buf, "%d\n", READ_ONCE( p_info->require_contiguous ) );
+}
 
-        wait_rv = wait_event_interruptible( p_info->wq, check_not_in_flight(p_info) );
+static ssize_t require_contiguous_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+    bool val;
 
-        if ( down_timeout( &p_info->sem, SEM_TAKE_TIMEOUT ) )
-        {
-            printk( KERN_ALERT KBUILD_MODNAME 
-                    ": %s: write sem take stalled for %d seconds -- probably broken\n",
-                    p_info->name,
-                    SEM_TAKE_TIMEOUT);
-            goto noup_out;
-        }
+    if ( kstrtobool( buf, &val ) )
+        return -EINVAL;
 
-        spin_lock_irq(&p_info->state_lock);
-        if ( p_info->state == DMA_IN_FLIGHT && -ERESTARTSYS == wait_rv )
-        {
-            dmaengine_terminate_all( p_info->chan );
-            rv = wait_rv;
-        }
+    WRITE_ONCE( p_info->require_contiguous, val );
 
-        ezdma_unprepare_after_dma( p_info );    // sets us back to DMA_IDLE
-        spin_unlock_irq(&p_info->state_lock);
-    }
+    return count;
+}
+static DEVICE_ATTR_RW(require_contiguous);
 
-    out:
-    up( &p_info->sem );
+static ssize_t rt_priority_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
 
-    noup_out:
-    return rv;
+    return sprintf( buf, "%u\n", p_info->rt_priority );
 }
 
-static int ezdma_release(struct inode *inode, struct file *filp)
+static ssize_t rt_priority_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
 {
-    struct ezdma_drvdata * p_info = container_of(inode->i_cdev, struct ezdma_drvdata, ezdma_cdev); 
+    struct ezdma_drvdata * p_info = (struct ezdma_drvdata*)dev_get_drvdata(dev);
+    unsigned int val;
+    ssize_t rv = count;
 
-    atomic_set( &p_info->accepting, 0 );    // disallow new reads/writes
+    if ( kstrtouint( buf, 0, &val ) || val >= MAX_RT_PRIO )
+        return -EINVAL;
 
     if ( down_interruptible( &p_info->sem ) )
         return -ERESTARTSYS;
 
-    dmaengine_terminate_all(p_info->chan);
-    // TODO: wake up any sleeping threads?
+    // callbacks pick their path as they fire, so only switch with nothing in flight
+    if ( p_info->gone )
+        rv = -ENODEV;
+    else if ( p_info->in_use )
+        rv = -EBUSY;
+    else if ( val != p_info->rt_priority )
+    {
+        ezdma_rt_stop( p_info );
 
-    p_info->in_use = 0;
+        if ( val )
+        {
+            int start_rv = ezdma_rt_start( p_info, val );
+
+            if ( start_rv )
+                rv = start_rv;
+        }
+    }
 
     up( &p_info->sem );
 
-    return 0;
+    return rv;
 }
-
-
-
-
+static DEVICE_ATTR_RW(rt_priority);
+
+static struct attribute *ezdma_attrs[] = {
+    &dev_attr_packets_sent.attr,
+    &dev_attr_packets_rcvd.attr,
+    &dev_attr_tx_queue_depth.attr,
+    &dev_attr_tx_bulk_depth.attr,
+    &dev_attr_numa_node.attr,
+    &dev_attr_completion_cpu.attr,
+    &dev_attr_cross_cpu_completions.attr,
+    &dev_attr_overruns.attr,
+    &dev_attr_filter_delivered.attr,
+    &dev_attr_filter_dropped.attr,
+    &dev_attr_filter_steered.attr,
+    &dev_attr_filter_triggered.attr,
+    &dev_attr_captures.attr,
+    &dev_attr_steer_completions.attr,
+    &dev_attr_require_contiguous.attr,
+    &dev_attr_rt_priority.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(ezdma);
 
 static int ezdma_create_device( struct ezdma_drvdata * p_info )
 {
@@ -638,52 +4406,217 @@ static int ezdma_create_device( struct ezdma_drvdata * p_info )
         return rv;
     }
 
-    cdev_init( &p_info->ezdma_cdev, &ezdma_fops );
-    p_info->ezdma_cdev.owner = THIS_MODULE;
+    if ( NULL == (p_info->ezdma_cdev = cdev_alloc()) )
+    {
+        put_devno(p_info->ezdma_devt);
+        p_info->ezdma_devt = MKDEV(0,0);
+        return -ENOMEM;
+    }
+
+    p_info->ezdma_cdev->ops = &ezdma_fops;
+    p_info->ezdma_cdev->owner = THIS_MODULE;
 
-    if ( (rv = cdev_add( &p_info->ezdma_cdev, p_info->ezdma_devt, 1 )) )
+    if ( (rv = cdev_add( p_info->ezdma_cdev, p_info->ezdma_devt, 1 )) )
     {
         printk(KERN_ERR KBUILD_MODNAME ": cdev_add() returned %d\n", rv);
+        kobject_put( &p_info->ezdma_cdev->kobj );
+        p_info->ezdma_cdev = NULL;
         put_devno(p_info->ezdma_devt);
         p_info->ezdma_devt = MKDEV(0,0);
         return rv;
     }
 
-    if ( NULL == (p_info->ezdma_dev = device_create( ezdma_class,
+    p_info->ezdma_dev = device_create_with_groups( ezdma_class,
                               &p_info->pdev->dev, 
                               p_info->ezdma_devt,
                               p_info,
-                              p_info->name)))
+                              ezdma_groups,
+                              p_info->name);
+
+    if ( IS_ERR( p_info->ezdma_dev ) )
     {
         printk(KERN_ERR KBUILD_MODNAME ": device_create() failed\n");
-        cdev_del( &p_info->ezdma_cdev );
+        rv = PTR_ERR( p_info->ezdma_dev );
+        p_info->ezdma_dev = NULL;
+        cdev_del( p_info->ezdma_cdev );
+        p_info->ezdma_cdev = NULL;
         put_devno( p_info->ezdma_devt );
         p_info->ezdma_devt = MKDEV(0,0);
-        return -ENOMEM;
+        return rv;
     }
 
+    set_devno_owner( p_info->ezdma_devt, p_info );
+
     return 0;
 }
 
 static void ezdma_teardown_device( struct ezdma_drvdata * p_info )
 {
     device_destroy( ezdma_class, p_info->ezdma_devt );
-    cdev_del( &p_info->ezdma_cdev );
+    cdev_del( p_info->ezdma_cdev );     // files already open keep it until they're closed
+    p_info->ezdma_cdev = NULL;
     put_devno( p_info->ezdma_devt );
     p_info->ezdma_devt = MKDEV(0,0);
+    p_info->ezdma_dev = NULL;
 }
 
 static void teardown_devices( struct ezdma_pdev_drvdata * p_pdev_info, struct platform_device *pdev);
 
+// when the node and every file opened through it are gone
+static void ezdma_drvdata_release( struct kref * ref )
+{
+    struct ezdma_drvdata * p_info = container_of( ref, struct ezdma_drvdata, ref );
+
+    if ( p_info->rx_status )
+        free_page( (unsigned long)p_info->rx_status );
+
+    kfree( p_info );
+}
+
+static void ezdma_put_drvdata( void * p_info )
+{
+    kref_put( &((struct ezdma_drvdata*)p_info)->ref, ezdma_drvdata_release );
+}
+
+// reads entry idx of a per-channel property; false if there isn't one
+static bool ezdma_of_chan_u32( struct ezdma_drvdata * p_info, const char * prop, int idx, u32 * val )
+{
+    return 0 == of_property_read_u32_index( p_info->pdev->dev.of_node, prop, idx, val );
+}
+
+static int ezdma_of_bad_value( struct ezdma_drvdata * p_info, const char * prop, u32 val )
+{
+    printk( KERN_ERR KBUILD_MODNAME ": %s: invalid \"%s\" value: %u\n", p_info->name, prop, val );
+    return -EINVAL;
+}
+
+/* Applies the optional per-channel tuning properties of the device tree, so a
+ * board's channels come up set for its traffic.  Each property has one entry
+ * per entry of "dma-names".  Those which set per-open state (timeouts, RX
+ * chunks) set what it's reset to on every open. */
+static int ezdma_of_tune( struct ezdma_drvdata * p_info, int idx )
+{
+    u32 val;
+    int rv;
+
+    if ( ezdma_of_chan_u32( p_info, "ezdma,alignments", idx, &val ) )
+    {
+        if ( 0 == val )
+            return ezdma_of_bad_value( p_info, "ezdma,alignments", val );
+
+        p_info->align = val;
+    }
+
+    if ( ezdma_of_chan_u32( p_info, "ezdma,max-packet-sizes", idx, &val ) && val )
+    {
+        p_info->max_packet = val;
+
+        // page lists for the largest transfer at any offset, so none is grown later
+        if ( (rv = ezdma_inflight_grow( p_info, DIV_ROUND_UP( val, PAGE_SIZE ) + 1 )) )
+            return rv;
+    }
+
+    if ( ezdma_of_chan_u32( p_info, "ezdma,tx-queue-depths", idx, &val ) )
+    {
+        if ( 0 == val )
+            return ezdma_of_bad_value( p_info, "ezdma,tx-queue-depths", val );
+
+        p_info->tx_queue_depth = val;
+        p_info->tx_bulk_depth = min( p_info->tx_bulk_depth, val );
+    }
+
+    if ( ezdma_of_chan_u32( p_info, "ezdma,tx-bulk-depths", idx, &val ) )
+    {
+        if ( 0 == val || val > p_info->tx_queue_depth )
+            return ezdma_of_bad_value( p_info, "ezdma,tx-bulk-depths", val );
+
+        p_info->tx_bulk_depth = val;
+    }
+
+    if ( ezdma_of_chan_u32( p_info, "ezdma,rx-chunk-sizes", idx, &val ) && val )
+    {
+        if ( EZDMA_DEV_TO_CPU != p_info->dir )
+            return ezdma_of_bad_value( p_info, "ezdma,rx-chunk-sizes", val );
+
+        p_info->default_rx_chunk_pages = DIV_ROUND_UP( val, PAGE_SIZE );
+    }
+
+    if ( ezdma_of_chan_u32( p_info, "ezdma,timeouts-ms", idx, &val ) )
+        p_info->default_timeout = msecs_to_jiffies( val );
+
+    if ( ezdma_of_chan_u32( p_info, "ezdma,steer-completions", idx, &val ) )
+        p_info->steer_completions = !!val;
+
+    if ( ezdma_of_chan_u32( p_info, "ezdma,rt-priorities", idx, &val ) && val )
+    {
+        if ( val >= MAX_RT_PRIO )
+            return ezdma_of_bad_value( p_info, "ezdma,rt-priorities", val );
+
+        if ( (rv = ezdma_rt_start( p_info, val )) )
+            return rv;
+    }
+
+    return 0;
+}
+
+/* Sets up the channel's "memory-region" and the pool preallocated at probe,
+ * if the device tree asks for them.  The node has either one region shared by
+ * all its channels, or one per entry of "dma-names". */
+static int ezdma_setup_static_pool( struct ezdma_drvdata * p_info, int idx )
+{
+    struct device_node * const np = p_info->pdev->dev.of_node;
+    const int num_regions = of_count_phandle_with_args( np, "memory-region", NULL );
+    struct ezdma_pool_class cls = { 0 };
+    int rv;
+
+    if ( num_regions > 0 )
+    {
+        struct device * const dev = p_info->ezdma_dev;
+
+        // the region's addresses are used by the engine, so give it the engine's mask
+        dev->coherent_dma_mask = ezdma_dma_dev( p_info )->coherent_dma_mask;
+        dev->dma_mask = &dev->coherent_dma_mask;
+
+        if ( (rv = of_reserved_mem_device_init_by_idx( dev, np, num_regions > 1 ? idx : 0 )) )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": %s: couldn't set up \"memory-region\": %d\n",
+                    p_info->name, rv );
+            return rv;
+        }
+
+        p_info->rmem_dev = dev;
+    }
+
+    if ( of_property_read_u32_index( np, "ezdma,pool-counts", idx, &cls.count ) || 0 == cls.count )
+        return 0;
+
+    if ( of_property_read_u32_index( np, "ezdma,pool-sizes", idx, &cls.size ) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: \"ezdma,pool-counts\" without \"ezdma,pool-sizes\"\n",
+                p_info->name );
+        return -EINVAL;
+    }
+
+    if ( (rv = ezdma_pool_alloc( p_info, &cls, 1, 0 )) )
+        return rv;
+
+    p_info->pool_static = true;
+
+    printk( KERN_INFO KBUILD_MODNAME ": %s: %u buffers of %u bytes%s\n",
+            p_info->name, cls.count, cls.size, p_info->rmem_dev ? " in reserved memory" : "" );
+
+    return 0;
+}
+
 static int create_devices( struct ezdma_pdev_drvdata * p_pdev_info, struct platform_device *pdev)
 {
     /*
      * read number of "dma-names" in my device tree entry
      * for each
-     *   allocate ezdma_drvdata
-     *   create devices
      *   acquire slave channel
+     *   allocate ezdma_drvdata, on the channel's NUMA node
      *   add to list
+     *   create devices
      */
 
     int num_dma_names = of_property_count_strings(pdev->dev.of_node, "dma-names");
@@ -705,29 +4638,10 @@ static int create_devices( struct ezdma_pdev_drvdata * p_pdev_info, struct platf
     for (dma_name_idx = 0; dma_name_idx < num_dma_names; dma_name_idx++)
     {
         struct ezdma_drvdata * p_info;
+        struct dma_chan * chan;
         const char * p_dma_name;
         int rv;
 
-        p_info = devm_kzalloc( &pdev->dev, sizeof(*p_info), GFP_KERNEL );
-
-        if ( !p_info )
-        {
-            printk( KERN_ERR KBUILD_MODNAME ": failed to allocate ezdma_drvdata\n");
-            outer_rv = -ENOMEM;
-            break;
-        }
-
-        /* Initialize fields */
-        p_info->pdev = pdev;
-        p_info->in_use = 0;
-        p_info->state = DMA_IDLE;
-        spin_lock_init( &p_info->state_lock );
-        list_add_tail( &p_info->node, &p_pdev_info->ezdma_list );
-        sema_init( &p_info->sem, 1 );
-        init_waitqueue_head( &p_info->wq );
-        atomic_set( &p_info->packets_sent, 0 );
-        atomic_set( &p_info->packets_rcvd, 0 );
-
         /* Read the dma name for the current index */
         rv = of_property_read_string_index(
                 pdev->dev.of_node, "dma-names",
@@ -741,14 +4655,82 @@ static int create_devices( struct ezdma_pdev_drvdata * p_pdev_info, struct platf
             outer_rv = rv;
             break;
         }
-        else
+
+        /* Get the named DMA channel first, so that p_info can go on its
+         * engine's node, and before there's a device node to open.  In an
+         * overlay the engine may well be probed after us. */
+        chan = dma_request_chan( &pdev->dev, p_dma_name );
+
+        if ( IS_ERR( chan ) )
         {
-            strncpy( p_info->name, p_dma_name, EZDMA_DEV_NAME_MAX_CHARS-1 );
-            p_info->name[EZDMA_DEV_NAME_MAX_CHARS-1] = '\0';
+            rv = PTR_ERR( chan );
+
+            if ( -EPROBE_DEFER == rv )
+                printk( KERN_INFO KBUILD_MODNAME
+                        ": couldn't find dma channel: %s, deferring...\n",
+                        p_dma_name);
+            else
+                printk( KERN_ERR KBUILD_MODNAME
+                        ": couldn't get dma channel %s: %d\n",
+                        p_dma_name, rv);
+
+            outer_rv = rv;
+            break;
+        }
+
+        // devm_kzalloc() can't place it, so hand kzalloc_node()'s result to devm;
+        // the node's reference is dropped with it, an open file's on close
+        p_info = kzalloc_node( sizeof(*p_info), GFP_KERNEL, dev_to_node( chan->device->dev ) );
 
-            //printk( KERN_DEBUG KBUILD_MODNAME ": setting up %s\n", p_info->name);
+        if ( p_info )
+            kref_init( &p_info->ref );
+
+        if ( !p_info || devm_add_action_or_reset( &pdev->dev, ezdma_put_drvdata, p_info ) )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": failed to allocate ezdma_drvdata\n");
+            dma_release_channel( chan );
+            outer_rv = -ENOMEM;
+            break;
         }
 
+        /* Initialize fields */
+        p_info->chan = chan;
+        p_info->pdev = pdev;
+        p_info->in_use = 0;
+        p_info->numa_node = NUMA_NO_NODE;
+        p_info->state = DMA_IDLE;
+        raw_spin_lock_init( &p_info->state_lock );
+        list_add_tail( &p_info->node, &p_pdev_info->ezdma_list );
+        sema_init( &p_info->sem, 1 );
+        init_waitqueue_head( &p_info->wq );
+        atomic_set( &p_info->packets_sent, 0 );
+        atomic_set( &p_info->packets_rcvd, 0 );
+        spin_lock_init( &p_info->pool.lock );
+        INIT_LIST_HEAD( &p_info->txq[EZDMA_PRIO_HIGH] );
+        INIT_LIST_HEAD( &p_info->txq[EZDMA_PRIO_NORMAL] );
+        INIT_LIST_HEAD( &p_info->tx_issued );
+        INIT_LIST_HEAD( &p_info->capture_hist );
+        INIT_DELAYED_WORK( &p_info->tx_watchdog, ezdma_tx_watchdog );
+        init_irq_work( &p_info->wake_work, ezdma_steered_wake );
+        init_llist_head( &p_info->rt_done );
+        init_llist_head( &p_info->rt_chunks );
+        atomic_set( &p_info->rt_rw_done, 0 );
+        mutex_init( &p_info->rt_lock );
+        p_info->callback_cpu = -1;
+        atomic_set( &p_info->cross_cpu_completions, 0 );
+        atomic_set( &p_info->overruns, 0 );
+        spin_lock_init( &p_info->limits_lock );
+        init_waitqueue_head( &p_info->limits_wq );
+        atomic64_set( &p_info->tx_outstanding, 0 );
+        p_info->tx_queue_depth = EZDMA_DEFAULT_TX_QUEUE_DEPTH;
+        p_info->tx_bulk_depth = EZDMA_DEFAULT_TX_BULK_DEPTH;
+        p_info->align = EZDMA_ALIGN_BYTES;
+
+        strncpy( p_info->name, p_dma_name, EZDMA_DEV_NAME_MAX_CHARS-1 );
+        p_info->name[EZDMA_DEV_NAME_MAX_CHARS-1] = '\0';
+
+        //printk( KERN_DEBUG KBUILD_MODNAME ": setting up %s\n", p_info->name);
+
 
         /* Read the direction for the current index */
         rv = of_property_read_u32_index(
@@ -776,23 +4758,36 @@ static int create_devices( struct ezdma_pdev_drvdata * p_pdev_info, struct platf
             break;
         }
 
-        if ( (rv = ezdma_create_device( p_info )) )
+        if ( EZDMA_DEV_TO_CPU == p_info->dir )
+        {
+            // not devm:  it can still be mmap()ed after the node is removed
+            p_info->rx_status = (struct ezdma_rx_status *)get_zeroed_page( GFP_KERNEL );
+
+            if ( !p_info->rx_status )
+            {
+                outer_rv = -ENOMEM;
+                break;
+            }
+        }
+
+        if ( (rv = ezdma_of_tune( p_info, dma_name_idx )) )
         {
             outer_rv = rv;
             break;
         }
 
-        /* Get the named DMA channel */
-        p_info->chan = dma_request_slave_channel(
-                    &pdev->dev, p_dma_name);
+        // it can be opened as soon as it's created, so an open waits for the pool
+        down( &p_info->sem );
 
-        if ( !p_info->chan )
-        {
-            printk( KERN_WARNING KBUILD_MODNAME 
-                    ": couldn't find dma channel: %s, deferring...\n",
-                    p_info->name);
+        if ( 0 == (rv = ezdma_create_device( p_info )) )
+            rv = ezdma_setup_static_pool( p_info, dma_name_idx );
+
+        up( &p_info->sem );
 
-            outer_rv = -EPROBE_DEFER;
+        if ( rv )
+        {
+            outer_rv = rv;
+            break;
         }
 
         printk( KERN_ALERT KBUILD_MODNAME ": %s (%s) available\n", 
@@ -813,28 +4808,98 @@ static int create_devices( struct ezdma_pdev_drvdata * p_pdev_info, struct platf
 
 
 
+/* Takes a channel away from its node, which may go at any time (an overlay
+ * being removed, or an unbind), without touching any other channel.  If it's
+ * open, the file keeps p_info until it's closed, but every use of it fails;
+ * a pool that's still mmap()ed stays until then as well, though the engine
+ * has stopped with it.
+ * p_info might be partially-initialized, so check pointers and be careful. */
+static void ezdma_unplug( struct ezdma_drvdata * p_info )
+{
+    struct ezdma_drvdata * rx = NULL;
+
+    if ( p_info->ezdma_cdev )
+        set_devno_owner( p_info->ezdma_devt, NULL );    // no new opens
+
+    down( &p_info->sem );
+
+    p_info->gone = true;
+    atomic_set( &p_info->accepting, 0 );
+
+    if ( EZDMA_DEV_TO_CPU == p_info->dir && p_info->fwd_peer )
+        ezdma_fwd_unbind( p_info );
+    else if ( EZDMA_CPU_TO_DEV == p_info->dir && (rx = p_info->fwd_peer) )
+        kref_get( &rx->ref );   // RX's sem comes first, so it's unbound below
+
+    up( &p_info->sem );
+
+    if ( rx )
+    {
+        down( &rx->sem );
+
+        if ( rx->fwd_peer == p_info )
+            ezdma_fwd_unbind( rx );
+
+        up( &rx->sem );
+
+        kref_put( &rx->ref, ezdma_drvdata_release );
+    }
+
+    down( &p_info->sem );
+
+    ezdma_stream_stop( p_info );
+    ezdma_tx_stop( p_info );
+    ezdma_terminate( p_info );
+
+    up( &p_info->sem );
+
+    // a read(), write() or trigger waiting gives up, and lets its pages go
+    wake_up( &p_info->wq );
+    wait_event( p_info->wq, check_idle( p_info ) );
+
+    cancel_delayed_work_sync( &p_info->tx_watchdog );
+    irq_work_sync( &p_info->wake_work );
+
+    down( &p_info->sem );
+
+    ezdma_rt_stop( p_info );
+    ezdma_prepared_drop( p_info );
+    ezdma_inflight_free( p_info );
+
+    if ( atomic_read( &p_info->pool.mmap_count ) )
+        p_info->pool_pinned = get_device( p_info->pool.dev );   // freed on close
+    else
+        ezdma_free_removed_pool( p_info );
+
+    up( &p_info->sem );
+
+    // sysfs is gone once this returns, so nothing else uses the channel
+    if ( p_info->ezdma_cdev )
+        ezdma_teardown_device( p_info );
+
+    down( &p_info->sem );
+
+    if ( p_info->chan )
+        dma_release_channel( p_info->chan );
+    p_info->chan = NULL;
+
+    up( &p_info->sem );
+}
+
 static void teardown_devices( struct ezdma_pdev_drvdata * p_pdev_info, struct platform_device *pdev)
 {
     struct ezdma_drvdata * p_info;
 
     list_for_each_entry( p_info, &p_pdev_info->ezdma_list, node )
     {
-        // p_info might be partially-initialized, so check pointers and be careful
         printk( KERN_DEBUG KBUILD_MODNAME ": tearing down %s\n",
                 p_info->name );    // name can only be all null-bytes or a valid string
 
-        if ( p_info->chan )
-        {
-            dmaengine_terminate_all(p_info->chan);
-            dma_release_channel(p_info->chan);
-        }
-
-        if ( p_info->ezdma_dev )
-            ezdma_teardown_device(p_info);
+        ezdma_unplug( p_info );
     }
 
     /* Note: we don't bother with the deallocations here, since they'll be
-     * cleaned up by devm_* unrolling. */
+     * cleaned up by devm_* unrolling, or when the last open file is closed. */
 }
 
 static int ezdma_probe(struct platform_device *pdev)
@@ -0,0 +1,487 @@
+/*
+ * ezdma_blk module -- Block device on a window of device memory (e.g. DDR
+ * attached to an FPGA's programmable logic), moved by dmaengine memcpy
+ * channels.
+ *
+ * Copyright (C) 2015 Jeremy Trimble
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/idr.h>
+
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+
+#define EZDMA_BLK_MAX_QUEUES    (8)
+#define EZDMA_BLK_QUEUE_DEPTH   (64)
+#define EZDMA_BLK_MAX_SEGS      (128)
+#define EZDMA_BLK_MINORS        (16)    // per disk, for partitions
+
+static int ezdma_blk_major;
+static DEFINE_IDA(ezdma_blk_ida);
+
+// a hardware queue: one memcpy channel, and the window as that channel's device sees it
+struct ezdma_blk_queue {
+    struct dma_chan *       chan;
+    dma_addr_t              window_dma;
+};
+
+struct ezdma_blk {
+    struct platform_device * pdev;
+    int                     idx;
+
+    phys_addr_t             window;
+    resource_size_t         window_size;
+
+    unsigned int            num_queues;
+    struct ezdma_blk_queue  queues[EZDMA_BLK_MAX_QUEUES];
+
+    struct blk_mq_tag_set   tag_set;
+    struct request_queue *  queue;
+    struct gendisk *        disk;
+};
+
+// per-request data, allocated by blk-mq alongside each request
+struct ezdma_blk_cmd {
+    struct ezdma_blk_queue * q;
+    unsigned int            nents;      // as mapped by blk_rq_map_sg()
+    atomic_t                pending;    // descriptors not yet completed, plus one while issuing
+    blk_status_t            status;
+    struct scatterlist      sg[EZDMA_BLK_MAX_SEGS];
+};
+
+static inline struct device * ezdma_blk_dma_dev( struct ezdma_blk_queue * q )
+{
+    return q->chan->device->dev;
+}
+
+static inline enum dma_data_direction ezdma_blk_data_dir( struct request * req )
+{
+    return REQ_OP_READ == req_op( req ) ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+}
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_blk_dma_done( void * data, const struct dmaengine_result * result )
+{
+    struct request * const req = (struct request*)data;
+    struct ezdma_blk_cmd * const cmd = blk_mq_rq_to_pdu( req );
+
+    if ( DMA_TRANS_NOERROR != result->result )
+        cmd->status = BLK_STS_IOERR;
+
+    if ( atomic_dec_and_test( &cmd->pending ) )
+        blk_mq_complete_request( req );
+}
+
+static void ezdma_blk_complete_rq( struct request * req )
+{
+    struct ezdma_blk_cmd * const cmd = blk_mq_rq_to_pdu( req );
+
+    dma_unmap_sg( ezdma_blk_dma_dev( cmd->q ), cmd->sg, cmd->nents, ezdma_blk_data_dir( req ) );
+
+    blk_mq_end_request( req, cmd->status );
+}
+
+static blk_status_t ezdma_blk_queue_rq( struct blk_mq_hw_ctx * hctx, const struct blk_mq_queue_data * bd )
+{
+    struct ezdma_blk * const blk = hctx->queue->queuedata;
+    struct ezdma_blk_queue * const q = hctx->driver_data;
+    struct request * const req = bd->rq;
+    struct ezdma_blk_cmd * const cmd = blk_mq_rq_to_pdu( req );
+    struct device * const dma_dev = ezdma_blk_dma_dev( q );
+    const u64 offset = (u64)blk_rq_pos( req ) << SECTOR_SHIFT;
+    struct scatterlist * sg;
+    unsigned int submitted = 0;
+    u64 pos = offset;
+    int mapped;
+    int i;
+
+    switch ( req_op( req ) )
+    {
+        case REQ_OP_READ:
+        case REQ_OP_WRITE:
+            break;
+
+        case REQ_OP_FLUSH:
+            // no cache of our own -- a completed write is in device memory
+            blk_mq_start_request( req );
+            blk_mq_end_request( req, BLK_STS_OK );
+            return BLK_STS_OK;
+
+        default:
+            return BLK_STS_NOTSUPP;
+    }
+
+    if ( offset + blk_rq_bytes( req ) > blk->window_size )
+        return BLK_STS_IOERR;
+
+    blk_mq_start_request( req );
+
+    cmd->q = q;
+    cmd->status = BLK_STS_OK;
+    cmd->nents = blk_rq_map_sg( hctx->queue, req, cmd->sg );
+
+    // the request's pages go straight to the engine; behind an IOMMU they may merge
+    mapped = dma_map_sg( dma_dev, cmd->sg, cmd->nents, ezdma_blk_data_dir( req ) );
+
+    if ( 0 == mapped )
+        return BLK_STS_RESOURCE;
+
+    atomic_set( &cmd->pending, 1 );
+
+    for_each_sg( cmd->sg, sg, mapped, i )
+    {
+        const dma_addr_t window_dma = q->window_dma + pos;
+        struct dma_async_tx_descriptor * txn_desc;
+
+        if ( REQ_OP_READ == req_op( req ) )
+            txn_desc = dmaengine_prep_dma_memcpy( q->chan, sg_dma_address( sg ), window_dma,
+                                                  sg_dma_len( sg ), DMA_PREP_INTERRUPT );
+        else
+            txn_desc = dmaengine_prep_dma_memcpy( q->chan, window_dma, sg_dma_address( sg ),
+                                                  sg_dma_len( sg ), DMA_PREP_INTERRUPT );
+
+        if ( !txn_desc )
+            break;
+
+        txn_desc->callback_result = ezdma_blk_dma_done;
+        txn_desc->callback_param = req;
+
+        atomic_inc( &cmd->pending );
+
+        if ( dma_submit_error( dmaengine_submit( txn_desc ) ) )
+        {
+            atomic_dec( &cmd->pending );
+            break;
+        }
+
+        submitted++;
+        pos += sg_dma_len( sg );
+    }
+
+    if ( 0 == submitted )
+    {
+        // nothing went out, so it can just be tried again later
+        dma_unmap_sg( dma_dev, cmd->sg, cmd->nents, ezdma_blk_data_dir( req ) );
+        return BLK_STS_RESOURCE;
+    }
+
+    if ( submitted < mapped )
+        cmd->status = BLK_STS_IOERR;    // what did go out still has to finish
+
+    dma_async_issue_pending( q->chan );
+
+    if ( atomic_dec_and_test( &cmd->pending ) )
+        blk_mq_complete_request( req );
+
+    return BLK_STS_OK;
+}
+
+static int ezdma_blk_init_hctx( struct blk_mq_hw_ctx * hctx, void * data, unsigned int hctx_idx )
+{
+    struct ezdma_blk * const blk = (struct ezdma_blk*)data;
+
+    hctx->driver_data = &blk->queues[ hctx_idx ];
+
+    return 0;
+}
+
+static int ezdma_blk_init_request( struct blk_mq_tag_set * set, struct request * req,
+                                   unsigned int hctx_idx, unsigned int numa_node )
+{
+    struct ezdma_blk_cmd * const cmd = blk_mq_rq_to_pdu( req );
+
+    sg_init_table( cmd->sg, EZDMA_BLK_MAX_SEGS );
+
+    return 0;
+}
+
+static const struct blk_mq_ops ezdma_blk_mq_ops = {
+    .queue_rq       = ezdma_blk_queue_rq,
+    .complete       = ezdma_blk_complete_rq,
+    .init_hctx      = ezdma_blk_init_hctx,
+    .init_request   = ezdma_blk_init_request,
+};
+
+static const struct block_device_operations ezdma_blk_fops = {
+    .owner = THIS_MODULE,
+};
+
+
+
+
+
+static void ezdma_blk_release_queues( struct ezdma_blk * blk )
+{
+    unsigned int i;
+
+    for ( i = 0; i < blk->num_queues; i++ )
+    {
+        struct ezdma_blk_queue * const q = &blk->queues[i];
+
+        dma_unmap_resource( ezdma_blk_dma_dev( q ), q->window_dma, blk->window_size, DMA_BIDIRECTIONAL, 0 );
+        dma_release_channel( q->chan );
+    }
+
+    blk->num_queues = 0;
+}
+
+/* Every "dma-names" entry is a memcpy channel, and becomes a hardware queue
+ * of its own. */
+static int ezdma_blk_request_queues( struct ezdma_blk * blk )
+{
+    struct device_node * const np = blk->pdev->dev.of_node;
+    const int num_names = of_property_count_strings( np, "dma-names" );
+    int rv = 0;
+    int i;
+
+    if ( num_names <= 0 || num_names > EZDMA_BLK_MAX_QUEUES )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": need 1 to %d \"dma-names\", got %d\n",
+                EZDMA_BLK_MAX_QUEUES, num_names );
+        return -EINVAL;
+    }
+
+    for ( i = 0; i < num_names; i++ )
+    {
+        struct ezdma_blk_queue * const q = &blk->queues[i];
+        const char * name;
+
+        if ( (rv = of_property_read_string_index( np, "dma-names", i, &name )) )
+            break;
+
+        q->chan = dma_request_chan( &blk->pdev->dev, name );
+
+        if ( IS_ERR( q->chan ) )
+        {
+            rv = PTR_ERR( q->chan );   // may well be -EPROBE_DEFER
+            break;
+        }
+
+        if ( !dma_has_cap( DMA_MEMCPY, q->chan->device->cap_mask ) )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": channel %s can't do memcpy\n", name );
+            dma_release_channel( q->chan );
+            rv = -EINVAL;
+            break;
+        }
+
+        q->window_dma = dma_map_resource( ezdma_blk_dma_dev( q ), blk->window, blk->window_size,
+                                          DMA_BIDIRECTIONAL, 0 );
+
+        if ( dma_mapping_error( ezdma_blk_dma_dev( q ), q->window_dma ) )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": couldn't map the window for channel %s\n", name );
+            dma_release_channel( q->chan );
+            rv = -ENOMEM;
+            break;
+        }
+
+        blk->num_queues++;
+    }
+
+    if ( rv )
+        ezdma_blk_release_queues( blk );
+
+    return rv;
+}
+
+// a request can go to any queue, so its segments must suit every engine
+static unsigned int ezdma_blk_max_seg_size( struct ezdma_blk * blk )
+{
+    unsigned int max = UINT_MAX;
+    unsigned int i;
+
+    for ( i = 0; i < blk->num_queues; i++ )
+        max = min( max, dma_get_max_seg_size( ezdma_blk_dma_dev( &blk->queues[i] ) ) );
+
+    return max;
+}
+
+// drops the disk from blk_mq_alloc_disk(), and before 6.0 the queue that came with it
+static void ezdma_blk_put_disk( struct ezdma_blk * blk )
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+    blk_cleanup_disk( blk->disk );
+#else
+    put_disk( blk->disk );
+#endif
+}
+
+static int ezdma_blk_probe( struct platform_device * pdev )
+{
+    struct ezdma_blk * blk;
+    struct resource * res;
+    int rv;
+
+    blk = devm_kzalloc( &pdev->dev, sizeof(*blk), GFP_KERNEL );
+
+    if ( !blk )
+        return -ENOMEM;
+
+    blk->pdev = pdev;
+
+    res = platform_get_resource( pdev, IORESOURCE_MEM, 0 );
+
+    if ( !res || resource_size( res ) < SECTOR_SIZE )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": no device memory window in \"reg\"\n" );
+        return -EINVAL;
+    }
+
+    blk->window = res->start;
+    blk->window_size = resource_size( res ) & ~(resource_size_t)(SECTOR_SIZE - 1);
+
+    if ( (rv = ezdma_blk_request_queues( blk )) )
+        return rv;
+
+    blk->tag_set.ops = &ezdma_blk_mq_ops;
+    blk->tag_set.nr_hw_queues = blk->num_queues;
+    blk->tag_set.queue_depth = EZDMA_BLK_QUEUE_DEPTH;
+    blk->tag_set.numa_node = dev_to_node( &pdev->dev );
+    blk->tag_set.cmd_size = sizeof(struct ezdma_blk_cmd);
+    blk->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    blk->tag_set.driver_data = blk;
+
+    if ( (rv = blk_mq_alloc_tag_set( &blk->tag_set )) )
+        goto err_queues;
+
+    if ( (blk->idx = ida_simple_get( &ezdma_blk_ida, 0, 0, GFP_KERNEL )) < 0 )
+    {
+        rv = blk->idx;
+        goto err_tag_set;
+    }
+
+    blk->disk = blk_mq_alloc_disk( &blk->tag_set, blk );
+
+    if ( IS_ERR( blk->disk ) )
+    {
+        rv = PTR_ERR( blk->disk );
+        goto err_ida;
+    }
+
+    blk->queue = blk->disk->queue;
+    blk_queue_logical_block_size( blk->queue, SECTOR_SIZE );
+    blk_queue_max_segments( blk->queue, EZDMA_BLK_MAX_SEGS );
+    blk_queue_max_segment_size( blk->queue, ezdma_blk_max_seg_size( blk ) );
+    blk_queue_flag_set( QUEUE_FLAG_NONROT, blk->queue );
+
+    blk->disk->major = ezdma_blk_major;
+    blk->disk->first_minor = blk->idx * EZDMA_BLK_MINORS;
+    blk->disk->minors = EZDMA_BLK_MINORS;
+    blk->disk->fops = &ezdma_blk_fops;
+    blk->disk->private_data = blk;
+    snprintf( blk->disk->disk_name, DISK_NAME_LEN, "ezdmablk%d", blk->idx );
+    set_capacity( blk->disk, blk->window_size >> SECTOR_SHIFT );
+
+    platform_set_drvdata( pdev, blk );
+
+    if ( (rv = add_disk( blk->disk )) )
+        goto err_disk;
+
+    printk( KERN_INFO KBUILD_MODNAME ": %s: %llu MiB at %pa, %u queues\n",
+            blk->disk->disk_name, (unsigned long long)(blk->window_size >> 20),
+            &blk->window, blk->num_queues );
+
+    return 0;
+
+    err_disk:
+    ezdma_blk_put_disk( blk );
+
+    err_ida:
+    ida_simple_remove( &ezdma_blk_ida, blk->idx );
+
+    err_tag_set:
+    blk_mq_free_tag_set( &blk->tag_set );
+
+    err_queues:
+    ezdma_blk_release_queues( blk );
+
+    return rv;
+}
+
+static int ezdma_blk_remove( struct platform_device * pdev )
+{
+    struct ezdma_blk * const blk = platform_get_drvdata( pdev );
+
+    del_gendisk( blk->disk );   // waits for requests in flight
+    ezdma_blk_put_disk( blk );
+    blk_mq_free_tag_set( &blk->tag_set );
+    ida_simple_remove( &ezdma_blk_ida, blk->idx );
+
+    ezdma_blk_release_queues( blk );
+
+    return 0;
+}
+
+/* Match table for of_platform binding */
+static const struct of_device_id ezdma_blk_of_match[] = {
+    { .compatible = "ezdma-blk" },
+    { /* end of list */ },
+};
+MODULE_DEVICE_TABLE(of, ezdma_blk_of_match);
+
+static struct platform_driver ezdma_blk_driver = {
+    .driver = {
+        .name = KBUILD_MODNAME,
+        .owner = THIS_MODULE,
+        .of_match_table = ezdma_blk_of_match,
+    },
+    .probe      = ezdma_blk_probe,
+    .remove     = ezdma_blk_remove,
+};
+
+static int __init ezdma_blk_init(void)
+{
+    int rv;
+
+    if ( (ezdma_blk_major = register_blkdev( 0, "ezdma_blk" )) < 0 )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": register_blkdev() returned %d\n", ezdma_blk_major );
+        return ezdma_blk_major;
+    }
+
+    if ( (rv = platform_driver_register( &ezdma_blk_driver )) )
+    {
+        unregister_blkdev( ezdma_blk_major, "ezdma_blk" );
+        return rv;
+    }
+
+    return 0;
+}
+
+static void __exit ezdma_blk_exit(void)
+{
+    platform_driver_unregister( &ezdma_blk_driver );
+    unregister_blkdev( ezdma_blk_major, "ezdma_blk" );
+}
+
+module_init(ezdma_blk_init);
+module_exit(ezdma_blk_exit);
+
+MODULE_AUTHOR("Jeremy Trimble <jeremy.trimble@gmail.com>");
+MODULE_DESCRIPTION("EZ DMA block device");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("0.1");
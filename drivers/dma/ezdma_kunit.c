@@ -0,0 +1,367 @@
+/*
+ * ezdma_kunit module -- KUnit tests and microbenchmarks of the scatterlist
+ * helpers read()/write() use (ezdma_sg.h).
+ *
+ * Copyright (C) 2015 Jeremy Trimble
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/scatterlist.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#include "ezdma_sg.h"
+
+/* More pages than fit in one scatterlist allocation, so the table is chained
+ * like the driver's is for large transfers. */
+#define EZDMA_KUNIT_PAGES   (160)
+#define EZDMA_KUNIT_SEGS    (32)    // DMA-mapped segments in the carving tests
+#define EZDMA_KUNIT_CHUNKS  (16)
+#define EZDMA_KUNIT_ROUNDS  (1000)  // random cases per test
+#define EZDMA_KUNIT_REPS    (10000) // per microbenchmark
+#define EZDMA_KUNIT_SEED    (0x657a646dULL)
+
+struct ezdma_kunit_ctx {
+    struct page *       pool[EZDMA_KUNIT_PAGES];    // real pages, sg_set_page() wants them
+    struct page *       pages[EZDMA_KUNIT_PAGES];   // ... in the order of a user buffer
+    struct sg_table     table;
+    struct rnd_state    rnd;
+
+    struct scatterlist  dma[EZDMA_KUNIT_SEGS];
+    struct scatterlist  segs[EZDMA_KUNIT_SEGS + EZDMA_KUNIT_CHUNKS];
+};
+
+// uniform in [0, n)
+static u32 ezdma_kunit_rand( struct ezdma_kunit_ctx * ctx, u32 n )
+{
+    return prandom_u32_state( &ctx->rnd ) % n;
+}
+
+// lays the first num_pages of pages out as a random user buffer would be
+static void ezdma_kunit_shuffle( struct ezdma_kunit_ctx * ctx, unsigned int num_pages )
+{
+    unsigned int i;
+
+    for ( i = 0; i < EZDMA_KUNIT_PAGES; i++ )
+        ctx->pages[i] = ctx->pool[i];
+
+    for ( i = num_pages - 1; i > 0; i-- )
+        swap( ctx->pages[i], ctx->pages[ ezdma_kunit_rand( ctx, i + 1 ) ] );
+}
+
+static int ezdma_kunit_init( struct kunit * test )
+{
+    struct ezdma_kunit_ctx * ctx;
+    unsigned int i;
+
+    ctx = kunit_kzalloc( test, sizeof(*ctx), GFP_KERNEL );
+    if ( !ctx )
+        return -ENOMEM;
+
+    for ( i = 0; i < EZDMA_KUNIT_PAGES; i++ )
+    {
+        if ( NULL == (ctx->pool[i] = alloc_page( GFP_KERNEL )) )
+            goto err_free;
+    }
+
+    if ( sg_alloc_table( &ctx->table, EZDMA_KUNIT_PAGES, GFP_KERNEL ) )
+        goto err_free;
+
+    prandom_seed_state( &ctx->rnd, EZDMA_KUNIT_SEED );
+
+    test->priv = ctx;
+
+    return 0;
+
+    err_free:
+    while ( i-- )
+        __free_page( ctx->pool[i] );
+
+    return -ENOMEM;
+}
+
+static void ezdma_kunit_exit( struct kunit * test )
+{
+    struct ezdma_kunit_ctx * ctx = test->priv;
+    unsigned int i;
+
+    if ( !ctx )
+        return;     // init failed, and cleaned up after itself
+
+    sg_free_table( &ctx->table );
+
+    for ( i = 0; i < EZDMA_KUNIT_PAGES; i++ )
+        __free_page( ctx->pool[i] );
+}
+
+/* Builds the list for a buffer of count bytes at offset into its first page,
+ * and checks every entry against the part of the buffer in that page. */
+static void ezdma_kunit_build_and_check( struct kunit * test, unsigned int offset, size_t count )
+{
+    struct ezdma_kunit_ctx * ctx = test->priv;
+    const unsigned int num_pages = DIV_ROUND_UP( offset + count, PAGE_SIZE );
+    struct scatterlist * sg;
+    size_t total = 0;
+    int i;
+
+    ezdma_kunit_shuffle( ctx, num_pages );
+    ezdma_build_sgl( ctx->table.sgl, ctx->pages, num_pages, offset, count );
+
+    KUNIT_EXPECT_EQ( test, sg_nents( ctx->table.sgl ), (int)num_pages );
+
+    for_each_sg( ctx->table.sgl, sg, num_pages, i )
+    {
+        // the buffer's bytes, counted from the start of its first page, in page i
+        const size_t page_start = (size_t)i * PAGE_SIZE;
+        const size_t start = max_t(size_t, page_start, offset);
+        const size_t end = min_t(size_t, page_start + PAGE_SIZE, offset + count);
+
+        KUNIT_EXPECT_PTR_EQ( test, sg_page( sg ), ctx->pages[i] );
+        KUNIT_EXPECT_EQ( test, (size_t)sg->offset, start - page_start );
+        KUNIT_EXPECT_EQ( test, (size_t)sg->length, end - start );
+
+        if ( i == num_pages - 1 )
+            KUNIT_EXPECT_TRUE( test, sg_is_last( sg ) );
+        else
+            KUNIT_EXPECT_FALSE( test, sg_is_last( sg ) );
+
+        total += sg->length;
+    }
+
+    KUNIT_EXPECT_EQ( test, total, count );
+}
+
+static void ezdma_kunit_build_edges( struct kunit * test )
+{
+    const size_t max = EZDMA_KUNIT_PAGES * PAGE_SIZE;
+
+    ezdma_kunit_build_and_check( test, 0, 1 );
+    ezdma_kunit_build_and_check( test, 0, PAGE_SIZE );
+    ezdma_kunit_build_and_check( test, 0, PAGE_SIZE + 1 );
+    ezdma_kunit_build_and_check( test, PAGE_SIZE - 1, 1 );
+    ezdma_kunit_build_and_check( test, PAGE_SIZE - 1, 2 );
+    ezdma_kunit_build_and_check( test, 1, PAGE_SIZE - 1 );
+    ezdma_kunit_build_and_check( test, 1, PAGE_SIZE );
+    ezdma_kunit_build_and_check( test, 0, max );
+    ezdma_kunit_build_and_check( test, 1, max - 1 );
+    ezdma_kunit_build_and_check( test, PAGE_SIZE - 1, max - PAGE_SIZE + 1 );
+
+    // longest, then shortest:  the old end of the list mustn't stay marked
+    ezdma_kunit_build_and_check( test, 0, max );
+    ezdma_kunit_build_and_check( test, 0, 1 );
+    ezdma_kunit_build_and_check( test, 0, max );
+}
+
+// random offsets, lengths and page layouts, in one table used over and over
+static void ezdma_kunit_build_random( struct kunit * test )
+{
+    struct ezdma_kunit_ctx * ctx = test->priv;
+    unsigned int r;
+
+    for ( r = 0; r < EZDMA_KUNIT_ROUNDS; r++ )
+    {
+        const unsigned int offset = ezdma_kunit_rand( ctx, PAGE_SIZE );
+        const size_t count = 1 + ezdma_kunit_rand( ctx, EZDMA_KUNIT_PAGES * PAGE_SIZE - offset );
+
+        ezdma_kunit_build_and_check( test, offset, count );
+    }
+}
+
+/* Makes num_segs mapped segments of random lengths, none adjacent to the next
+ * so a piece carved across a boundary shows.  Returns their total length. */
+static size_t ezdma_kunit_make_segs( struct ezdma_kunit_ctx * ctx, unsigned int num_segs )
+{
+    struct scatterlist * sg;
+    size_t total = 0;
+    int i;
+
+    sg_init_table( ctx->dma, num_segs );
+
+    for_each_sg( ctx->dma, sg, num_segs, i )
+    {
+        sg_dma_address( sg ) = 0x10000000ULL + (dma_addr_t)i * 0x100000;
+        sg_dma_len( sg ) = 1 + ezdma_kunit_rand( ctx, 4 * PAGE_SIZE );
+        total += sg_dma_len( sg );
+    }
+
+    return total;
+}
+
+/* Carves the segments into random chunks, as the chunks of a progressive RX
+ * are, and checks that the pieces run through the segments in order, end to
+ * end, within the capacity the driver sizes segs for. */
+static void ezdma_kunit_carve_random( struct kunit * test )
+{
+    struct ezdma_kunit_ctx * ctx = test->priv;
+    unsigned int r;
+
+    for ( r = 0; r < EZDMA_KUNIT_ROUNDS; r++ )
+    {
+        const unsigned int num_segs = 1 + ezdma_kunit_rand( ctx, EZDMA_KUNIT_SEGS );
+        const size_t total = ezdma_kunit_make_segs( ctx, num_segs );
+        const unsigned int num_chunks = 1 + ezdma_kunit_rand( ctx, min_t(size_t, total, EZDMA_KUNIT_CHUNKS) );
+        struct scatterlist * dma_sg = ctx->dma;
+        size_t dma_left = sg_dma_len( dma_sg );
+        struct scatterlist * exp_sg = ctx->dma;     // where the next piece should come from
+        size_t exp_used = 0;
+        size_t left = total;
+        unsigned int used = 0;
+        unsigned int c;
+
+        for ( c = 0; c < num_chunks; c++ )
+        {
+            // every chunk gets at least a byte, the last one whatever's left
+            const size_t len = (c == num_chunks - 1) ? left :
+                               1 + ezdma_kunit_rand( ctx, left - (num_chunks - 1 - c) );
+            struct scatterlist * const segs = &ctx->segs[ used ];
+            unsigned int n;
+            unsigned int j;
+            size_t carved = 0;
+
+            n = ezdma_carve_segs( segs, &dma_sg, &dma_left, len );
+
+            KUNIT_ASSERT_LE( test, used + n, num_segs + num_chunks );
+
+            for ( j = 0; j < n; j++ )
+            {
+                if ( exp_used == sg_dma_len( exp_sg ) )
+                {
+                    exp_sg = sg_next( exp_sg );
+                    exp_used = 0;
+                }
+
+                KUNIT_ASSERT_NOT_ERR_OR_NULL( test, exp_sg );
+                KUNIT_EXPECT_EQ( test, (u64)sg_dma_address( &segs[j] ), (u64)(sg_dma_address( exp_sg ) + exp_used) );
+                KUNIT_EXPECT_EQ( test, (size_t)sg_dma_len( &segs[j] ),
+                                 min_t(size_t, len - carved, sg_dma_len( exp_sg ) - exp_used) );
+
+                exp_used += sg_dma_len( &segs[j] );
+                carved += sg_dma_len( &segs[j] );
+            }
+
+            KUNIT_EXPECT_EQ( test, carved, len );
+
+            used += n;
+            left -= len;
+        }
+
+        KUNIT_EXPECT_EQ( test, left, (size_t)0 );
+        KUNIT_EXPECT_EQ( test, dma_left, (size_t)0 );
+        KUNIT_EXPECT_TRUE( test, sg_is_last( dma_sg ) );
+    }
+}
+
+/*
+ * Microbenchmarks.  They only report, in the test log, so a change to the
+ * helpers can be compared before and after on the same machine.
+ */
+
+static void ezdma_kunit_bench_build( struct kunit * test )
+{
+    static const unsigned int sizes[] = { 1, 16, EZDMA_KUNIT_PAGES };
+    struct ezdma_kunit_ctx * ctx = test->priv;
+    unsigned int s;
+
+    for ( s = 0; s < ARRAY_SIZE(sizes); s++ )
+    {
+        const unsigned int num_pages = sizes[s];
+        const size_t count = num_pages * PAGE_SIZE - 1;     // starts a byte in
+        struct sg_table table;
+        unsigned int r;
+        u64 t_kept;
+        u64 t_alloc;
+
+        ezdma_kunit_shuffle( ctx, num_pages );
+
+        // as read()/write() do it, in the table kept between calls
+        t_kept = ktime_get_ns();
+        for ( r = 0; r < EZDMA_KUNIT_REPS; r++ )
+            ezdma_build_sgl( ctx->table.sgl, ctx->pages, num_pages, 1, count );
+        t_kept = ktime_get_ns() - t_kept;
+
+        // with the table set up and torn down every time
+        t_alloc = ktime_get_ns();
+        for ( r = 0; r < EZDMA_KUNIT_REPS; r++ )
+        {
+            KUNIT_ASSERT_EQ( test, sg_alloc_table( &table, num_pages, GFP_KERNEL ), 0 );
+            ezdma_build_sgl( table.sgl, ctx->pages, num_pages, 1, count );
+            sg_free_table( &table );
+        }
+        t_alloc = ktime_get_ns() - t_alloc;
+
+        kunit_info( test, "%3u pages:  build %llu ns, alloc+build+free %llu ns\n",
+                    num_pages, div_u64( t_kept, EZDMA_KUNIT_REPS ), div_u64( t_alloc, EZDMA_KUNIT_REPS ) );
+    }
+}
+
+static void ezdma_kunit_bench_carve( struct kunit * test )
+{
+    struct ezdma_kunit_ctx * ctx = test->priv;
+    const size_t total = ezdma_kunit_make_segs( ctx, EZDMA_KUNIT_SEGS );
+    const size_t chunk = DIV_ROUND_UP( total, EZDMA_KUNIT_CHUNKS );
+    unsigned int r;
+    u64 t;
+
+    t = ktime_get_ns();
+    for ( r = 0; r < EZDMA_KUNIT_REPS; r++ )
+    {
+        struct scatterlist * dma_sg = ctx->dma;
+        size_t dma_left = sg_dma_len( dma_sg );
+        size_t left = total;
+        unsigned int used = 0;
+
+        while ( left )
+        {
+            const size_t len = min( left, chunk );
+
+            used += ezdma_carve_segs( &ctx->segs[ used ], &dma_sg, &dma_left, len );
+            left -= len;
+        }
+    }
+    t = ktime_get_ns() - t;
+
+    kunit_info( test, "%u segments into %u chunks:  %llu ns\n",
+                EZDMA_KUNIT_SEGS, EZDMA_KUNIT_CHUNKS, div_u64( t, EZDMA_KUNIT_REPS ) );
+}
+
+static struct kunit_case ezdma_kunit_cases[] = {
+    KUNIT_CASE(ezdma_kunit_build_edges),
+    KUNIT_CASE(ezdma_kunit_build_random),
+    KUNIT_CASE(ezdma_kunit_carve_random),
+    KUNIT_CASE(ezdma_kunit_bench_build),
+    KUNIT_CASE(ezdma_kunit_bench_carve),
+    {}
+};
+
+static struct kunit_suite ezdma_kunit_suite = {
+    .name = "ezdma",
+    .init = ezdma_kunit_init,
+    .exit = ezdma_kunit_exit,
+    .test_cases = ezdma_kunit_cases,
+};
+
+kunit_test_suite(ezdma_kunit_suite);
+
+MODULE_AUTHOR("Jeremy Trimble <jeremy.trimble@gmail.com>");
+MODULE_DESCRIPTION("EZ DMA scatterlist tests");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("0.1");
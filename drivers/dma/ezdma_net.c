@@ -0,0 +1,618 @@
+/*
+ * ezdma_net module -- Network interface on a TX/RX pair of dmaengine
+ * channels carrying Ethernet frames, e.g. over AXI-stream to an FPGA.
+ *
+ * Copyright (C) 2015 Jeremy Trimble
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/of_net.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/timer.h>
+
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+
+#include <linux/netdevice.h>
+#include <linux/etherdevice.h>
+#include <linux/skbuff.h>
+#include <net/page_pool.h>
+
+#define EZDMA_NET_DEFAULT_RX_RING   (256)
+#define EZDMA_NET_DEFAULT_TX_RING   (128)
+#define EZDMA_NET_NAPI_WEIGHT       (64)
+#define EZDMA_NET_REFILL_RETRY_MS   (10)    // page_pool ran dry with nothing posted
+
+/* Frames are received straight into page_pool pages and built into skbs in
+ * place, so each page keeps the stack's headroom in front of the frame and
+ * room for the skb_shared_info behind it. */
+#define EZDMA_NET_RX_HEADROOM   (NET_SKB_PAD + NET_IP_ALIGN)
+#define EZDMA_NET_RX_BUF_LEN    (PAGE_SIZE - EZDMA_NET_RX_HEADROOM - \
+                                 SKB_DATA_ALIGN(sizeof(struct skb_shared_info)))
+
+struct ezdma_net;
+
+struct ezdma_net_rx_slot {
+    struct ezdma_net *      priv;
+    struct page *           page;
+    u32                     len;    // of the frame, valid once done
+    bool                    error;
+    bool                    done;   // set by the completion callback, cleared when reposted
+};
+
+struct ezdma_net_tx_slot {
+    struct ezdma_net *      priv;
+    struct sk_buff *        skb;
+    unsigned int            nents;
+    struct scatterlist      sg[MAX_SKB_FRAGS + 1];  // linear part, then the frags
+};
+
+/* Both rings are posted to and complete in order.  head is the oldest slot
+ * that's still posted, tail the next one to post; they count up forever and
+ * are taken modulo the ring size. */
+struct ezdma_net {
+    struct net_device *     ndev;
+    struct napi_struct      napi;
+
+    struct dma_chan *       tx_chan;
+    struct dma_chan *       rx_chan;
+
+    struct page_pool *      page_pool;
+    struct ezdma_net_rx_slot * rx_slots;
+    unsigned int            rx_ring_size;
+    unsigned int            rx_head;    // both only touched by NAPI, or with it disabled
+    unsigned int            rx_tail;
+    struct timer_list       rx_refill_timer;    // reschedules NAPI when nothing is posted
+
+    struct ezdma_net_tx_slot * tx_slots;
+    unsigned int            tx_ring_size;
+    unsigned int            tx_head;    // advanced by the completion callback
+    unsigned int            tx_tail;    // advanced by ndo_start_xmit
+};
+
+static inline struct device * ezdma_net_dma_dev( struct dma_chan * chan )
+{
+    return chan->device->dev;
+}
+
+
+
+
+
+/*
+ * RX: every slot of the ring holds a page posted to the engine as one
+ * descriptor.  Completions only mark their slot done and kick NAPI, which
+ * hands the frames to the stack and posts new pages in their place.
+ */
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_net_rx_done( void * data, const struct dmaengine_result * result )
+{
+    struct ezdma_net_rx_slot * const slot = (struct ezdma_net_rx_slot*)data;
+
+    slot->error = (DMA_TRANS_NOERROR != result->result);
+    slot->len = EZDMA_NET_RX_BUF_LEN - min_t( u32, result->residue, EZDMA_NET_RX_BUF_LEN );
+
+    smp_wmb();  // NAPI reads len and error once it sees done
+    WRITE_ONCE( slot->done, true );
+
+    napi_schedule( &slot->priv->napi );
+}
+
+// should be called from NAPI, or with NAPI disabled.  Caller issues pending.
+static int ezdma_net_rx_post( struct ezdma_net * priv )
+{
+    struct ezdma_net_rx_slot * const slot = &priv->rx_slots[ priv->rx_tail % priv->rx_ring_size ];
+    struct dma_async_tx_descriptor * txn_desc;
+
+    // page_pool has already synced it for the device (PP_FLAG_DMA_SYNC_DEV)
+    if ( !slot->page && !(slot->page = page_pool_dev_alloc_pages( priv->page_pool )) )
+        return -ENOMEM;
+
+    txn_desc = dmaengine_prep_slave_single( priv->rx_chan,
+            page_pool_get_dma_addr( slot->page ) + EZDMA_NET_RX_HEADROOM,
+            EZDMA_NET_RX_BUF_LEN,
+            DMA_DEV_TO_MEM,
+            DMA_PREP_INTERRUPT );
+
+    if ( !txn_desc )
+        return -ENOMEM;     // the page stays in the slot for the next try
+
+    txn_desc->callback_result = ezdma_net_rx_done;
+    txn_desc->callback_param = slot;
+    slot->done = false;
+
+    if ( dma_submit_error( dmaengine_submit( txn_desc ) ) )
+        return -EIO;
+
+    priv->rx_tail++;
+
+    return 0;
+}
+
+// post every free slot.  Caller issues pending.
+static void ezdma_net_rx_refill( struct ezdma_net * priv )
+{
+    while ( priv->rx_tail - priv->rx_head < priv->rx_ring_size )
+    {
+        if ( ezdma_net_rx_post( priv ) )
+            break;  // retried on the next poll, or from rx_refill_timer
+    }
+}
+
+static int ezdma_net_poll( struct napi_struct * napi, int budget )
+{
+    struct ezdma_net * const priv = container_of( napi, struct ezdma_net, napi );
+    struct net_device * const ndev = priv->ndev;
+    struct device * const dma_dev = ezdma_net_dma_dev( priv->rx_chan );
+    int done = 0;
+
+    while ( done < budget && priv->rx_head != priv->rx_tail )
+    {
+        struct ezdma_net_rx_slot * const slot = &priv->rx_slots[ priv->rx_head % priv->rx_ring_size ];
+        struct page * const page = slot->page;
+        struct sk_buff * skb;
+
+        if ( !READ_ONCE( slot->done ) )
+            break;
+
+        smp_rmb();
+
+        priv->rx_head++;
+        done++;
+        slot->page = NULL;
+
+        if ( slot->error || slot->len < ETH_HLEN )
+        {
+            ndev->stats.rx_errors++;
+            page_pool_recycle_direct( priv->page_pool, page );
+            continue;
+        }
+
+        dma_sync_single_range_for_cpu( dma_dev, page_pool_get_dma_addr( page ),
+                EZDMA_NET_RX_HEADROOM, slot->len, DMA_FROM_DEVICE );
+
+        skb = build_skb( page_address( page ), PAGE_SIZE );
+
+        if ( !skb )
+        {
+            ndev->stats.rx_dropped++;
+            page_pool_recycle_direct( priv->page_pool, page );
+            continue;
+        }
+
+        // the stack frees the page with the skb, so it leaves the pool
+        page_pool_release_page( priv->page_pool, page );
+
+        skb_reserve( skb, EZDMA_NET_RX_HEADROOM );
+        skb_put( skb, slot->len );
+        skb->protocol = eth_type_trans( skb, ndev );
+
+        ndev->stats.rx_packets++;
+        ndev->stats.rx_bytes += slot->len;
+
+        napi_gro_receive( napi, skb );
+    }
+
+    ezdma_net_rx_refill( priv );
+    dma_async_issue_pending( priv->rx_chan );
+
+    // with nothing posted, no callback will come to schedule us again
+    if ( done < budget && napi_complete_done( napi, done ) && priv->rx_head == priv->rx_tail )
+        mod_timer( &priv->rx_refill_timer, jiffies + msecs_to_jiffies( EZDMA_NET_REFILL_RETRY_MS ) );
+
+    return done;
+}
+
+static void ezdma_net_rx_refill_retry( struct timer_list * t )
+{
+    struct ezdma_net * const priv = from_timer( priv, t, rx_refill_timer );
+
+    napi_schedule( &priv->napi );   // a no-op once NAPI is disabled
+}
+
+
+
+
+
+/*
+ * TX: the skb's linear part and frags are mapped as they are and sent as one
+ * descriptor, so nothing is copied.  Engines without scatter-gather need
+ * "ethtool -K <dev> sg off", so that skbs arrive linear.
+ */
+
+static void ezdma_net_tx_unmap( struct ezdma_net * priv, struct ezdma_net_tx_slot * slot )
+{
+    struct device * const dma_dev = ezdma_net_dma_dev( priv->tx_chan );
+    unsigned int i;
+
+    for ( i = 0; i < slot->nents; i++ )
+    {
+        if ( 0 == i )
+            dma_unmap_single( dma_dev, sg_dma_address( &slot->sg[i] ), sg_dma_len( &slot->sg[i] ), DMA_TO_DEVICE );
+        else
+            dma_unmap_page( dma_dev, sg_dma_address( &slot->sg[i] ), sg_dma_len( &slot->sg[i] ), DMA_TO_DEVICE );
+    }
+
+    slot->nents = 0;
+}
+
+static inline unsigned int ezdma_net_tx_used( struct ezdma_net * priv )
+{
+    return priv->tx_tail - READ_ONCE( priv->tx_head );
+}
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_net_tx_done( void * data, const struct dmaengine_result * result )
+{
+    struct ezdma_net_tx_slot * const slot = (struct ezdma_net_tx_slot*)data;
+    struct ezdma_net * const priv = slot->priv;
+    struct net_device * const ndev = priv->ndev;
+    struct sk_buff * const skb = slot->skb;
+
+    ezdma_net_tx_unmap( priv, slot );
+
+    if ( DMA_TRANS_NOERROR == result->result )
+    {
+        ndev->stats.tx_packets++;
+        ndev->stats.tx_bytes += skb->len;
+    }
+    else
+    {
+        ndev->stats.tx_errors++;
+    }
+
+    netdev_completed_queue( ndev, 1, skb->len );
+    dev_consume_skb_any( skb );
+    slot->skb = NULL;
+
+    WRITE_ONCE( priv->tx_head, priv->tx_head + 1 );
+    smp_mb();   // pairs with the one in ezdma_net_start_xmit()
+
+    if ( netif_queue_stopped( ndev ) && ezdma_net_tx_used( priv ) < priv->tx_ring_size )
+        netif_wake_queue( ndev );
+}
+
+static netdev_tx_t ezdma_net_start_xmit( struct sk_buff * skb, struct net_device * ndev )
+{
+    struct ezdma_net * const priv = netdev_priv( ndev );
+    struct device * const dma_dev = ezdma_net_dma_dev( priv->tx_chan );
+    struct ezdma_net_tx_slot * const slot = &priv->tx_slots[ priv->tx_tail % priv->tx_ring_size ];
+    struct dma_async_tx_descriptor * txn_desc;
+    unsigned int i;
+
+    if ( ezdma_net_tx_used( priv ) >= priv->tx_ring_size )
+    {
+        netif_stop_queue( ndev );
+        return NETDEV_TX_BUSY;  // shouldn't happen, we stop when the ring fills
+    }
+
+    sg_init_table( slot->sg, skb_shinfo( skb )->nr_frags + 1 );
+
+    sg_dma_address( &slot->sg[0] ) = dma_map_single( dma_dev, skb->data, skb_headlen( skb ), DMA_TO_DEVICE );
+    sg_dma_len( &slot->sg[0] ) = skb_headlen( skb );
+
+    if ( dma_mapping_error( dma_dev, sg_dma_address( &slot->sg[0] ) ) )
+        goto err_drop;
+
+    slot->nents = 1;
+
+    for ( i = 0; i < skb_shinfo( skb )->nr_frags; i++ )
+    {
+        const skb_frag_t * const frag = &skb_shinfo( skb )->frags[i];
+        struct scatterlist * const sg = &slot->sg[ slot->nents ];
+
+        sg_dma_address( sg ) = skb_frag_dma_map( dma_dev, frag, 0, skb_frag_size( frag ), DMA_TO_DEVICE );
+        sg_dma_len( sg ) = skb_frag_size( frag );
+
+        if ( dma_mapping_error( dma_dev, sg_dma_address( sg ) ) )
+            goto err_unmap;
+
+        slot->nents++;
+    }
+
+    txn_desc = dmaengine_prep_slave_sg( priv->tx_chan, slot->sg, slot->nents, DMA_MEM_TO_DEV, DMA_PREP_INTERRUPT );
+
+    if ( !txn_desc )
+        goto err_unmap;
+
+    txn_desc->callback_result = ezdma_net_tx_done;
+    txn_desc->callback_param = slot;
+    slot->skb = skb;
+
+    if ( dma_submit_error( dmaengine_submit( txn_desc ) ) )
+    {
+        slot->skb = NULL;
+        goto err_unmap;
+    }
+
+    netdev_sent_queue( ndev, skb->len );
+    priv->tx_tail++;
+
+    // stop while the ring is full, then look again in case tx_done just missed it
+    if ( ezdma_net_tx_used( priv ) >= priv->tx_ring_size )
+    {
+        netif_stop_queue( ndev );
+        smp_mb();
+
+        if ( ezdma_net_tx_used( priv ) < priv->tx_ring_size )
+            netif_start_queue( ndev );
+    }
+
+    if ( !netdev_xmit_more() || netif_queue_stopped( ndev ) )
+        dma_async_issue_pending( priv->tx_chan );
+
+    return NETDEV_TX_OK;
+
+    err_unmap:
+    ezdma_net_tx_unmap( priv, slot );
+
+    err_drop:
+    ndev->stats.tx_dropped++;
+    dev_kfree_skb_any( skb );
+
+    return NETDEV_TX_OK;
+}
+
+
+
+
+
+static int ezdma_net_open( struct net_device * ndev )
+{
+    struct ezdma_net * const priv = netdev_priv( ndev );
+
+    priv->rx_head = priv->rx_tail = 0;
+    priv->tx_head = priv->tx_tail = 0;
+    netdev_reset_queue( ndev );
+
+    // before posting, so that the first completions can schedule it
+    napi_enable( &priv->napi );
+
+    ezdma_net_rx_refill( priv );
+
+    if ( priv->rx_head == priv->rx_tail )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": %s: couldn't post any RX buffers\n", ndev->name );
+        napi_disable( &priv->napi );
+        return -ENOMEM;
+    }
+
+    dma_async_issue_pending( priv->rx_chan );
+
+    netif_start_queue( ndev );
+
+    return 0;
+}
+
+static int ezdma_net_stop( struct net_device * ndev )
+{
+    struct ezdma_net * const priv = netdev_priv( ndev );
+    unsigned int i;
+
+    netif_stop_queue( ndev );
+    napi_disable( &priv->napi );
+    del_timer_sync( &priv->rx_refill_timer );   // after NAPI, which could arm it again
+
+    dmaengine_terminate_sync( priv->rx_chan );
+    dmaengine_terminate_sync( priv->tx_chan );
+
+    // whatever was still posted never completed
+    for ( ; priv->tx_head != priv->tx_tail; priv->tx_head++ )
+    {
+        struct ezdma_net_tx_slot * const slot = &priv->tx_slots[ priv->tx_head % priv->tx_ring_size ];
+
+        ezdma_net_tx_unmap( priv, slot );
+        dev_kfree_skb_any( slot->skb );
+        slot->skb = NULL;
+    }
+
+    for ( i = 0; i < priv->rx_ring_size; i++ )
+    {
+        struct ezdma_net_rx_slot * const slot = &priv->rx_slots[i];
+
+        if ( slot->page )
+            page_pool_put_full_page( priv->page_pool, slot->page, false );
+
+        slot->page = NULL;
+    }
+
+    return 0;
+}
+
+static const struct net_device_ops ezdma_net_netdev_ops = {
+    .ndo_open               = ezdma_net_open,
+    .ndo_stop               = ezdma_net_stop,
+    .ndo_start_xmit         = ezdma_net_start_xmit,
+    .ndo_set_mac_address    = eth_mac_addr,
+    .ndo_validate_addr      = eth_validate_addr,
+};
+
+
+
+
+
+static int ezdma_net_probe( struct platform_device * pdev )
+{
+    struct device_node * const np = pdev->dev.of_node;
+    struct page_pool_params pp_params = { 0 };
+    struct dma_slave_caps caps;
+    struct net_device * ndev;
+    struct ezdma_net * priv;
+    u8 mac[ETH_ALEN];
+    unsigned int i;
+    int rv;
+
+    ndev = devm_alloc_etherdev( &pdev->dev, sizeof(*priv) );
+
+    if ( !ndev )
+        return -ENOMEM;
+
+    SET_NETDEV_DEV( ndev, &pdev->dev );
+
+    priv = netdev_priv( ndev );
+    priv->ndev = ndev;
+    priv->rx_ring_size = EZDMA_NET_DEFAULT_RX_RING;
+    priv->tx_ring_size = EZDMA_NET_DEFAULT_TX_RING;
+
+    of_property_read_u32( np, "ezdma,rx-ring-size", &priv->rx_ring_size );
+    of_property_read_u32( np, "ezdma,tx-ring-size", &priv->tx_ring_size );
+
+    if ( 0 == priv->rx_ring_size || 0 == priv->tx_ring_size )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": ring sizes must be nonzero\n" );
+        return -EINVAL;
+    }
+
+    priv->rx_slots = devm_kcalloc( &pdev->dev, priv->rx_ring_size, sizeof(*priv->rx_slots), GFP_KERNEL );
+    priv->tx_slots = devm_kcalloc( &pdev->dev, priv->tx_ring_size, sizeof(*priv->tx_slots), GFP_KERNEL );
+
+    if ( !priv->rx_slots || !priv->tx_slots )
+        return -ENOMEM;
+
+    for ( i = 0; i < priv->rx_ring_size; i++ )
+        priv->rx_slots[i].priv = priv;
+
+    for ( i = 0; i < priv->tx_ring_size; i++ )
+        priv->tx_slots[i].priv = priv;
+
+    priv->tx_chan = dma_request_chan( &pdev->dev, "tx" );
+
+    if ( IS_ERR( priv->tx_chan ) )
+        return PTR_ERR( priv->tx_chan );   // may well be -EPROBE_DEFER
+
+    priv->rx_chan = dma_request_chan( &pdev->dev, "rx" );
+
+    if ( IS_ERR( priv->rx_chan ) )
+    {
+        rv = PTR_ERR( priv->rx_chan );
+        goto err_release_tx;
+    }
+
+    // the length of each frame comes from the residue of its descriptor
+    if ( dma_get_slave_caps( priv->rx_chan, &caps ) ||
+         DMA_RESIDUE_GRANULARITY_DESCRIPTOR == caps.residue_granularity )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": RX engine can't report frame lengths\n" );
+        rv = -EOPNOTSUPP;
+        goto err_release_rx;
+    }
+
+    pp_params.flags = PP_FLAG_DMA_MAP | PP_FLAG_DMA_SYNC_DEV;
+    pp_params.order = 0;
+    pp_params.pool_size = priv->rx_ring_size;
+    pp_params.nid = dev_to_node( ezdma_net_dma_dev( priv->rx_chan ) );
+    pp_params.dev = ezdma_net_dma_dev( priv->rx_chan );
+    pp_params.dma_dir = DMA_FROM_DEVICE;
+    pp_params.offset = EZDMA_NET_RX_HEADROOM;
+    pp_params.max_len = EZDMA_NET_RX_BUF_LEN;
+
+    priv->page_pool = page_pool_create( &pp_params );
+
+    if ( IS_ERR( priv->page_pool ) )
+    {
+        rv = PTR_ERR( priv->page_pool );
+        goto err_release_rx;
+    }
+
+    if ( !of_get_mac_address( np, mac ) )
+        eth_hw_addr_set( ndev, mac );
+    else
+        eth_hw_addr_random( ndev );
+
+    ndev->netdev_ops = &ezdma_net_netdev_ops;
+    ndev->hw_features = NETIF_F_SG;
+    ndev->features = NETIF_F_SG;
+    ndev->min_mtu = ETH_MIN_MTU;
+    ndev->max_mtu = EZDMA_NET_RX_BUF_LEN - ETH_HLEN;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 19, 0)
+    netif_napi_add( ndev, &priv->napi, ezdma_net_poll, EZDMA_NET_NAPI_WEIGHT );
+#else
+    netif_napi_add_weight( ndev, &priv->napi, ezdma_net_poll, EZDMA_NET_NAPI_WEIGHT );
+#endif
+    timer_setup( &priv->rx_refill_timer, ezdma_net_rx_refill_retry, 0 );
+
+    platform_set_drvdata( pdev, priv );
+
+    if ( (rv = register_netdev( ndev )) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": register_netdev() returned %d\n", rv );
+        goto err_napi;
+    }
+
+    printk( KERN_INFO KBUILD_MODNAME ": %s: %s/%s, rings %u/%u\n", ndev->name,
+            dma_chan_name( priv->tx_chan ), dma_chan_name( priv->rx_chan ),
+            priv->tx_ring_size, priv->rx_ring_size );
+
+    return 0;
+
+    err_napi:
+    netif_napi_del( &priv->napi );
+    page_pool_destroy( priv->page_pool );
+
+    err_release_rx:
+    dma_release_channel( priv->rx_chan );
+
+    err_release_tx:
+    dma_release_channel( priv->tx_chan );
+
+    return rv;
+}
+
+static int ezdma_net_remove( struct platform_device * pdev )
+{
+    struct ezdma_net * const priv = platform_get_drvdata( pdev );
+
+    unregister_netdev( priv->ndev );   // stops it first
+    netif_napi_del( &priv->napi );
+    page_pool_destroy( priv->page_pool );
+
+    dma_release_channel( priv->rx_chan );
+    dma_release_channel( priv->tx_chan );
+
+    return 0;
+}
+
+/* Match table for of_platform binding */
+static const struct of_device_id ezdma_net_of_match[] = {
+    { .compatible = "ezdma-net" },
+    { /* end of list */ },
+};
+MODULE_DEVICE_TABLE(of, ezdma_net_of_match);
+
+static struct platform_driver ezdma_net_driver = {
+    .driver = {
+        .name = KBUILD_MODNAME,
+        .owner = THIS_MODULE,
+        .of_match_table = ezdma_net_of_match,
+    },
+    .probe      = ezdma_net_probe,
+    .remove     = ezdma_net_remove,
+};
+
+module_platform_driver(ezdma_net_driver);
+
+MODULE_AUTHOR("Jeremy Trimble <jeremy.trimble@gmail.com>");
+MODULE_DESCRIPTION("EZ DMA network interface");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("0.1");
@@ -0,0 +1,96 @@
+/*
+ * ezdma module -- scatterlist helpers of read()/write(), shared with the
+ * KUnit tests (ezdma_kunit.c).
+ *
+ * Copyright (C) 2015 Jeremy Trimble
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EZDMA_SG_H
+#define EZDMA_SG_H
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+
+/* Fills in sgl for a user buffer of count bytes, starting offset bytes into
+ * the first of its num_pages pinned pages, and ends the list there.  sgl is a
+ * table that may have been used for a longer buffer before.
+ *
+ * Like ezdma_carve_segs(), it touches nothing but its arguments, so the offset
+ * and length arithmetic is checked, and timed, on its own by ezdma_kunit. */
+static inline void ezdma_build_sgl(
+        struct scatterlist * sgl,
+        struct page ** pages,
+        unsigned int num_pages,
+        unsigned int offset,
+        size_t count
+)
+{
+    struct scatterlist * sg;
+    size_t left_to_map = count;
+    int i;
+
+    for_each_sg( sgl, sg, num_pages, i )
+    {
+        // only the first page starts part way in
+        const unsigned int len = min_t(size_t, left_to_map, PAGE_SIZE - offset);
+
+        sg_unmark_end( sg );    // the table may have ended here last time
+        sg_set_page( sg, pages[i], len, offset );
+        left_to_map -= len;
+        offset = 0;
+
+        if ( i == num_pages - 1 )
+            sg_mark_end( sg );
+    }
+}
+
+/* Carves len bytes off the DMA-mapped segments into segs, starting dma_left
+ * bytes from the end of *dma_sg, and moves both on past them for the next
+ * chunk.  Returns how many of segs it used. */
+static inline unsigned int ezdma_carve_segs(
+        struct scatterlist * segs,
+        struct scatterlist ** dma_sg,
+        size_t * dma_left,
+        size_t len
+)
+{
+    unsigned int n = 0;
+
+    while ( len )
+    {
+        struct scatterlist * const seg = &segs[ n++ ];
+        size_t piece;
+
+        if ( 0 == *dma_left )
+        {
+            *dma_sg = sg_next( *dma_sg );
+            *dma_left = sg_dma_len( *dma_sg );
+        }
+
+        piece = min( len, *dma_left );
+
+        sg_dma_address( seg ) = sg_dma_address( *dma_sg ) + sg_dma_len( *dma_sg ) - *dma_left;
+        sg_dma_len( seg ) = piece;
+
+        len -= piece;
+        *dma_left -= piece;
+    }
+
+    return n;
+}
+
+#endif /* EZDMA_SG_H */
@@ -0,0 +1,529 @@
+/*
+ * ezdma_v4l2 module -- V4L2 capture device on a dmaengine RX channel which
+ * delivers one video frame per transfer, e.g. over AXI-stream from an FPGA.
+ *
+ * Copyright (C) 2015 Jeremy Trimble
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/of.h>
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+
+#include <linux/dmaengine.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+
+#include <media/v4l2-device.h>
+#include <media/v4l2-dev.h>
+#include <media/v4l2-ioctl.h>
+#include <media/v4l2-common.h>
+#include <media/videobuf2-v4l2.h>
+#include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-dma-sg.h>
+
+struct ezdma_v4l2 {
+    struct platform_device * pdev;
+    struct dma_chan *       chan;
+    bool                    contig;     // whole frames in one piece of memory
+
+    struct v4l2_device      v4l2_dev;
+    struct video_device     vdev;
+    struct vb2_queue        queue;
+    struct mutex            lock;       // serializes the ioctls, and the queue
+
+    struct v4l2_pix_format  fmt;        // fixed, from the device tree
+
+    spinlock_t              qlock;      // protects posted
+    struct list_head        posted;     // buffers handed to the engine
+    u32                     sequence;
+};
+
+struct ezdma_v4l2_buf {
+    struct vb2_v4l2_buffer  vb;         // must be first
+    struct list_head        list;
+    struct ezdma_v4l2 *     priv;
+    u32                     len;        // of the transfer, which may be more than a frame
+};
+
+static inline struct ezdma_v4l2_buf * to_ezdma_v4l2_buf( struct vb2_buffer * vb )
+{
+    return container_of( to_vb2_v4l2_buffer( vb ), struct ezdma_v4l2_buf, vb );
+}
+
+static inline struct device * ezdma_v4l2_dma_dev( struct ezdma_v4l2 * priv )
+{
+    return priv->chan->device->dev;
+}
+
+// this runs in tasklet (interrupt) context -- no sleeping!
+static void ezdma_v4l2_rx_done( void * data, const struct dmaengine_result * result )
+{
+    struct ezdma_v4l2_buf * const buf = (struct ezdma_v4l2_buf*)data;
+    struct ezdma_v4l2 * const priv = buf->priv;
+    enum vb2_buffer_state state = VB2_BUF_STATE_DONE;
+    unsigned long flags;
+
+    spin_lock_irqsave( &priv->qlock, flags );
+    list_del( &buf->list );
+    spin_unlock_irqrestore( &priv->qlock, flags );
+
+    // a frame that ended early leaves the buffer with stale lines in it
+    if ( DMA_TRANS_NOERROR != result->result || buf->len - result->residue != priv->fmt.sizeimage )
+        state = VB2_BUF_STATE_ERROR;
+
+    buf->vb.vb2_buf.timestamp = ktime_get_ns();
+    buf->vb.sequence = priv->sequence++;
+    buf->vb.field = V4L2_FIELD_NONE;
+
+    vb2_buffer_done( &buf->vb.vb2_buf, state );
+}
+
+static int ezdma_v4l2_queue_setup( struct vb2_queue * vq, unsigned int * nbuffers, unsigned int * nplanes,
+                                   unsigned int sizes[], struct device * alloc_devs[] )
+{
+    struct ezdma_v4l2 * const priv = vb2_get_drv_priv( vq );
+
+    if ( *nplanes )
+        return sizes[0] < priv->fmt.sizeimage ? -EINVAL : 0;
+
+    *nplanes = 1;
+    sizes[0] = priv->fmt.sizeimage;
+
+    return 0;
+}
+
+static int ezdma_v4l2_buf_prepare( struct vb2_buffer * vb )
+{
+    struct ezdma_v4l2 * const priv = vb2_get_drv_priv( vb->vb2_queue );
+
+    if ( vb2_plane_size( vb, 0 ) < priv->fmt.sizeimage )
+        return -EINVAL;
+
+    vb2_set_plane_payload( vb, 0, priv->fmt.sizeimage );
+
+    return 0;
+}
+
+/* Every queued buffer goes to the engine right away, so the engine always has
+ * somewhere to put the next frame without waiting on us. */
+static void ezdma_v4l2_buf_queue( struct vb2_buffer * vb )
+{
+    struct ezdma_v4l2 * const priv = vb2_get_drv_priv( vb->vb2_queue );
+    struct ezdma_v4l2_buf * const buf = to_ezdma_v4l2_buf( vb );
+    struct dma_async_tx_descriptor * txn_desc;
+    unsigned long flags;
+
+    if ( priv->contig )
+    {
+        buf->len = priv->fmt.sizeimage;
+        txn_desc = dmaengine_prep_slave_single( priv->chan,
+                vb2_dma_contig_plane_dma_addr( vb, 0 ),
+                priv->fmt.sizeimage,
+                DMA_DEV_TO_MEM,
+                DMA_PREP_INTERRUPT );
+    }
+    else
+    {
+        struct sg_table * const sgt = vb2_dma_sg_plane_desc( vb, 0 );
+
+        // the whole buffer, as the engine ends the transfer at the end of the frame
+        buf->len = vb2_plane_size( vb, 0 );
+        txn_desc = dmaengine_prep_slave_sg( priv->chan, sgt->sgl, sgt->nents,
+                DMA_DEV_TO_MEM,
+                DMA_PREP_INTERRUPT );
+    }
+
+    if ( !txn_desc )
+    {
+        vb2_buffer_done( vb, VB2_BUF_STATE_ERROR );
+        return;
+    }
+
+    buf->priv = priv;
+    txn_desc->callback_result = ezdma_v4l2_rx_done;
+    txn_desc->callback_param = buf;
+
+    spin_lock_irqsave( &priv->qlock, flags );
+    list_add_tail( &buf->list, &priv->posted );
+    spin_unlock_irqrestore( &priv->qlock, flags );
+
+    if ( dma_submit_error( dmaengine_submit( txn_desc ) ) )
+    {
+        spin_lock_irqsave( &priv->qlock, flags );
+        list_del( &buf->list );
+        spin_unlock_irqrestore( &priv->qlock, flags );
+
+        vb2_buffer_done( vb, VB2_BUF_STATE_ERROR );
+        return;
+    }
+
+    // buffers queued before STREAMON wait for start_streaming()
+    if ( vb2_is_streaming( vb->vb2_queue ) )
+        dma_async_issue_pending( priv->chan );
+}
+
+// hand back every buffer the engine still has, in the given state
+static void ezdma_v4l2_return_posted( struct ezdma_v4l2 * priv, enum vb2_buffer_state state )
+{
+    struct ezdma_v4l2_buf * buf;
+    struct ezdma_v4l2_buf * tmp;
+    unsigned long flags;
+
+    spin_lock_irqsave( &priv->qlock, flags );
+
+    list_for_each_entry_safe( buf, tmp, &priv->posted, list )
+    {
+        list_del( &buf->list );
+        vb2_buffer_done( &buf->vb.vb2_buf, state );
+    }
+
+    spin_unlock_irqrestore( &priv->qlock, flags );
+}
+
+static int ezdma_v4l2_start_streaming( struct vb2_queue * vq, unsigned int count )
+{
+    struct ezdma_v4l2 * const priv = vb2_get_drv_priv( vq );
+
+    priv->sequence = 0;
+
+    dma_async_issue_pending( priv->chan );
+
+    return 0;
+}
+
+static void ezdma_v4l2_stop_streaming( struct vb2_queue * vq )
+{
+    struct ezdma_v4l2 * const priv = vb2_get_drv_priv( vq );
+
+    // no callbacks run after this, so posted is ours alone
+    dmaengine_terminate_sync( priv->chan );
+
+    ezdma_v4l2_return_posted( priv, VB2_BUF_STATE_ERROR );
+}
+
+static const struct vb2_ops ezdma_v4l2_qops = {
+    .queue_setup        = ezdma_v4l2_queue_setup,
+    .buf_prepare        = ezdma_v4l2_buf_prepare,
+    .buf_queue          = ezdma_v4l2_buf_queue,
+    .start_streaming    = ezdma_v4l2_start_streaming,
+    .stop_streaming     = ezdma_v4l2_stop_streaming,
+    .wait_prepare       = vb2_ops_wait_prepare,
+    .wait_finish        = vb2_ops_wait_finish,
+};
+
+
+
+
+
+static int ezdma_v4l2_querycap( struct file * file, void * fh, struct v4l2_capability * cap )
+{
+    struct ezdma_v4l2 * const priv = video_drvdata( file );
+
+    strscpy( cap->driver, KBUILD_MODNAME, sizeof(cap->driver) );
+    strscpy( cap->card, priv->vdev.name, sizeof(cap->card) );
+    snprintf( cap->bus_info, sizeof(cap->bus_info), "platform:%s", dev_name( &priv->pdev->dev ) );
+
+    return 0;
+}
+
+static int ezdma_v4l2_enum_fmt( struct file * file, void * fh, struct v4l2_fmtdesc * f )
+{
+    struct ezdma_v4l2 * const priv = video_drvdata( file );
+
+    if ( f->index > 0 )
+        return -EINVAL;
+
+    f->pixelformat = priv->fmt.pixelformat;
+
+    return 0;
+}
+
+// the FPGA decides the format, so every "try" and "set" gets the one it sends
+static int ezdma_v4l2_g_fmt( struct file * file, void * fh, struct v4l2_format * f )
+{
+    struct ezdma_v4l2 * const priv = video_drvdata( file );
+
+    f->fmt.pix = priv->fmt;
+
+    return 0;
+}
+
+static int ezdma_v4l2_s_fmt( struct file * file, void * fh, struct v4l2_format * f )
+{
+    struct ezdma_v4l2 * const priv = video_drvdata( file );
+
+    if ( vb2_is_busy( &priv->queue ) )
+        return -EBUSY;
+
+    return ezdma_v4l2_g_fmt( file, fh, f );
+}
+
+static int ezdma_v4l2_enum_framesizes( struct file * file, void * fh, struct v4l2_frmsizeenum * fsize )
+{
+    struct ezdma_v4l2 * const priv = video_drvdata( file );
+
+    if ( fsize->index > 0 || fsize->pixel_format != priv->fmt.pixelformat )
+        return -EINVAL;
+
+    fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+    fsize->discrete.width = priv->fmt.width;
+    fsize->discrete.height = priv->fmt.height;
+
+    return 0;
+}
+
+static int ezdma_v4l2_enum_input( struct file * file, void * fh, struct v4l2_input * inp )
+{
+    if ( inp->index > 0 )
+        return -EINVAL;
+
+    inp->type = V4L2_INPUT_TYPE_CAMERA;
+    strscpy( inp->name, "Camera", sizeof(inp->name) );
+
+    return 0;
+}
+
+static int ezdma_v4l2_g_input( struct file * file, void * fh, unsigned int * i )
+{
+    *i = 0;
+
+    return 0;
+}
+
+static int ezdma_v4l2_s_input( struct file * file, void * fh, unsigned int i )
+{
+    return i > 0 ? -EINVAL : 0;
+}
+
+static const struct v4l2_ioctl_ops ezdma_v4l2_ioctl_ops = {
+    .vidioc_querycap            = ezdma_v4l2_querycap,
+    .vidioc_enum_fmt_vid_cap    = ezdma_v4l2_enum_fmt,
+    .vidioc_g_fmt_vid_cap       = ezdma_v4l2_g_fmt,
+    .vidioc_s_fmt_vid_cap       = ezdma_v4l2_s_fmt,
+    .vidioc_try_fmt_vid_cap     = ezdma_v4l2_g_fmt,
+    .vidioc_enum_framesizes     = ezdma_v4l2_enum_framesizes,
+    .vidioc_enum_input          = ezdma_v4l2_enum_input,
+    .vidioc_g_input             = ezdma_v4l2_g_input,
+    .vidioc_s_input             = ezdma_v4l2_s_input,
+
+    .vidioc_reqbufs             = vb2_ioctl_reqbufs,
+    .vidioc_create_bufs         = vb2_ioctl_create_bufs,
+    .vidioc_prepare_buf         = vb2_ioctl_prepare_buf,
+    .vidioc_querybuf            = vb2_ioctl_querybuf,
+    .vidioc_qbuf                = vb2_ioctl_qbuf,
+    .vidioc_dqbuf               = vb2_ioctl_dqbuf,
+    .vidioc_expbuf              = vb2_ioctl_expbuf,
+    .vidioc_streamon            = vb2_ioctl_streamon,
+    .vidioc_streamoff           = vb2_ioctl_streamoff,
+};
+
+static const struct v4l2_file_operations ezdma_v4l2_fops = {
+    .owner          = THIS_MODULE,
+    .open           = v4l2_fh_open,
+    .release        = vb2_fop_release,
+    .read           = vb2_fop_read,
+    .poll           = vb2_fop_poll,
+    .mmap           = vb2_fop_mmap,
+    .unlocked_ioctl = video_ioctl2,
+};
+
+
+
+
+
+/* Frame geometry comes from the device tree: the FPGA sends what it sends.
+ * Bytes per line and frame size follow from the format, unless the design
+ * pads its lines, in which case "ezdma,bytes-per-line" says by how much. */
+static int ezdma_v4l2_of_format( struct ezdma_v4l2 * priv )
+{
+    struct device_node * const np = priv->pdev->dev.of_node;
+    const char * fourcc;
+    u32 width;
+    u32 height;
+    u32 stride;
+    int rv;
+
+    if ( of_property_read_u32( np, "ezdma,width", &width ) ||
+         of_property_read_u32( np, "ezdma,height", &height ) ||
+         of_property_read_string( np, "ezdma,pixel-format", &fourcc ) ||
+         4 != strlen( fourcc ) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": need \"ezdma,width\", \"ezdma,height\" and a four-character \"ezdma,pixel-format\"\n" );
+        return -EINVAL;
+    }
+
+    if ( (rv = v4l2_fill_pixfmt( &priv->fmt, v4l2_fourcc( fourcc[0], fourcc[1], fourcc[2], fourcc[3] ),
+                                 width, height )) )
+    {
+        printk( KERN_ERR KBUILD_MODNAME ": unknown pixel format %s\n", fourcc );
+        return rv;
+    }
+
+    if ( !of_property_read_u32( np, "ezdma,bytes-per-line", &stride ) )
+    {
+        if ( stride < priv->fmt.bytesperline )
+        {
+            printk( KERN_ERR KBUILD_MODNAME ": \"ezdma,bytes-per-line\" is less than a line of %s\n", fourcc );
+            return -EINVAL;
+        }
+
+        priv->fmt.sizeimage = priv->fmt.sizeimage / priv->fmt.bytesperline * stride;
+        priv->fmt.bytesperline = stride;
+    }
+
+    priv->fmt.field = V4L2_FIELD_NONE;
+    priv->fmt.colorspace = V4L2_COLORSPACE_SRGB;
+
+    return 0;
+}
+
+/* An open file keeps the video device, and so priv, past remove().  With no
+ * v4l2_dev.release, the core leaves freeing v4l2_dev to this as well. */
+static void ezdma_v4l2_release( struct video_device * vdev )
+{
+    struct ezdma_v4l2 * const priv = container_of( vdev, struct ezdma_v4l2, vdev );
+
+    v4l2_device_unregister( &priv->v4l2_dev );
+    kfree( priv );
+}
+
+static int ezdma_v4l2_probe( struct platform_device * pdev )
+{
+    struct ezdma_v4l2 * priv;
+    struct vb2_queue * q;
+    int rv;
+
+    priv = kzalloc( sizeof(*priv), GFP_KERNEL );
+
+    if ( !priv )
+        return -ENOMEM;
+
+    priv->pdev = pdev;
+    mutex_init( &priv->lock );
+    spin_lock_init( &priv->qlock );
+    INIT_LIST_HEAD( &priv->posted );
+
+    if ( (rv = ezdma_v4l2_of_format( priv )) )
+        goto err_free;
+
+    priv->contig = of_property_read_bool( pdev->dev.of_node, "ezdma,contiguous" );
+
+    priv->chan = dma_request_chan( &pdev->dev, "rx" );
+
+    if ( IS_ERR( priv->chan ) )
+    {
+        rv = PTR_ERR( priv->chan );     // may well be -EPROBE_DEFER
+        goto err_free;
+    }
+
+    if ( (rv = v4l2_device_register( &pdev->dev, &priv->v4l2_dev )) )
+        goto err_chan;
+
+    // buffers are allocated (or imported) for the engine, not for us
+    q = &priv->queue;
+    q->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    q->io_modes = VB2_MMAP | VB2_DMABUF | VB2_READ;
+    q->drv_priv = priv;
+    q->buf_struct_size = sizeof(struct ezdma_v4l2_buf);
+    q->ops = &ezdma_v4l2_qops;
+    q->mem_ops = priv->contig ? &vb2_dma_contig_memops : &vb2_dma_sg_memops;
+    q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    q->min_buffers_needed = 2;
+    q->lock = &priv->lock;
+    q->dev = ezdma_v4l2_dma_dev( priv );
+
+    if ( (rv = vb2_queue_init( q )) )
+        goto err_v4l2;
+
+    strscpy( priv->vdev.name, dev_name( &pdev->dev ), sizeof(priv->vdev.name) );
+    priv->vdev.fops = &ezdma_v4l2_fops;
+    priv->vdev.ioctl_ops = &ezdma_v4l2_ioctl_ops;
+    priv->vdev.release = video_device_release_empty;   // a failed registration may call it
+    priv->vdev.v4l2_dev = &priv->v4l2_dev;
+    priv->vdev.queue = q;
+    priv->vdev.lock = &priv->lock;
+    priv->vdev.device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
+    video_set_drvdata( &priv->vdev, priv );
+
+    platform_set_drvdata( pdev, priv );
+
+    if ( (rv = video_register_device( &priv->vdev, VFL_TYPE_VIDEO, -1 )) )
+        goto err_queue;
+
+    priv->vdev.release = ezdma_v4l2_release;
+
+    printk( KERN_INFO KBUILD_MODNAME ": %s: %ux%u, %u bytes per frame\n",
+            video_device_node_name( &priv->vdev ), priv->fmt.width, priv->fmt.height, priv->fmt.sizeimage );
+
+    return 0;
+
+    err_queue:
+    vb2_queue_release( q );
+
+    err_v4l2:
+    v4l2_device_unregister( &priv->v4l2_dev );
+
+    err_chan:
+    dma_release_channel( priv->chan );
+
+    err_free:
+    kfree( priv );
+
+    return rv;
+}
+
+static int ezdma_v4l2_remove( struct platform_device * pdev )
+{
+    struct ezdma_v4l2 * const priv = platform_get_drvdata( pdev );
+    struct dma_chan * const chan = priv->chan;
+
+    // stops streaming and frees the buffers, so the channel is done with;
+    // priv goes with the last close, which may be this
+    vb2_video_unregister_device( &priv->vdev );
+
+    dma_release_channel( chan );
+
+    return 0;
+}
+
+/* Match table for of_platform binding */
+static const struct of_device_id ezdma_v4l2_of_match[] = {
+    { .compatible = "ezdma-v4l2" },
+    { /* end of list */ },
+};
+MODULE_DEVICE_TABLE(of, ezdma_v4l2_of_match);
+
+static struct platform_driver ezdma_v4l2_driver = {
+    .driver = {
+        .name = KBUILD_MODNAME,
+        .owner = THIS_MODULE,
+        .of_match_table = ezdma_v4l2_of_match,
+    },
+    .probe      = ezdma_v4l2_probe,
+    .remove     = ezdma_v4l2_remove,
+};
+
+module_platform_driver(ezdma_v4l2_driver);
+
+MODULE_AUTHOR("Jeremy Trimble <jeremy.trimble@gmail.com>");
+MODULE_DESCRIPTION("EZ DMA video capture device");
+MODULE_LICENSE("GPL");
+MODULE_VERSION("0.1");
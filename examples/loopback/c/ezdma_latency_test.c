@@ -0,0 +1,124 @@
+/*
+ezdma loopback latency test
+Copyright (C) 2015 Jeremy Trimble
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Times NUM_TRIALS write()+read() round trips through the loopback and
+ * prints the latency distribution.  Worst case is what matters for RT, so
+ * run it for a good while under whatever load the real system will see.
+ *
+ *   usage: ezdma_latency_test [packet size] [SCHED_FIFO priority]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define NUM_TRIALS (100000)
+#define MAX_PACKET_SIZE (65536)
+
+uint8_t tx_buf[MAX_PACKET_SIZE];
+uint8_t rx_buf[MAX_PACKET_SIZE];
+double latency_us[NUM_TRIALS];
+
+static int compare_doubles(const void *a, const void *b)
+{
+    const double da = *(const double*)a;
+    const double db = *(const double*)b;
+
+    return (da > db) - (da < db);
+}
+
+static double elapsed_us(const struct timespec *tick, const struct timespec *tock)
+{
+    return (tock->tv_sec - tick->tv_sec) * 1e6 + (tock->tv_nsec - tick->tv_nsec) / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+    const int packet_size = argc > 1 ? atoi(argv[1]) : 64;
+    const int priority = argc > 2 ? atoi(argv[2]) : 0;
+    struct timespec tick, tock;
+    double sum = 0;
+    int i;
+
+    int tx_fd = open("/dev/loop_tx", O_WRONLY);
+    int rx_fd = open("/dev/loop_rx", O_RDONLY);
+
+    if ( tx_fd < 0 || rx_fd < 0 )
+    {
+        perror("can't open loop devices\n");
+        return 2;
+    }
+
+    if ( packet_size <= 0 || packet_size > MAX_PACKET_SIZE )
+    {
+        fprintf(stderr, "packet size must be 1..%d\n", MAX_PACKET_SIZE);
+        return 2;
+    }
+
+    // keep page faults and lower-priority work out of the measurement
+    if ( mlockall(MCL_CURRENT | MCL_FUTURE) )
+        perror("mlockall");
+
+    if ( priority > 0 )
+    {
+        struct sched_param param = { .sched_priority = priority };
+
+        if ( sched_setscheduler(0, SCHED_FIFO, &param) )
+            perror("sched_setscheduler");
+    }
+
+    for (i = 0; i < packet_size; ++i)
+        tx_buf[i] = i; // automatically mod-256
+
+    // warm up, so the driver's page lists are already big enough
+    assert( packet_size == write(tx_fd, tx_buf, packet_size) );
+    assert( packet_size == read (rx_fd, rx_buf, packet_size) );
+
+    for (i = 0; i < NUM_TRIALS; ++i)
+    {
+        assert( !clock_gettime(CLOCK_MONOTONIC, &tick) );
+        assert( packet_size == write(tx_fd, tx_buf, packet_size) );
+        assert( packet_size == read (rx_fd, rx_buf, packet_size) );
+        assert( !clock_gettime(CLOCK_MONOTONIC, &tock) );
+
+        latency_us[i] = elapsed_us(&tick, &tock);
+        sum += latency_us[i];
+    }
+
+    qsort(latency_us, NUM_TRIALS, sizeof(latency_us[0]), compare_doubles);
+
+    printf("%d round trips of %d bytes, latency in us:\n", NUM_TRIALS, packet_size);
+    printf("  min %.1f  avg %.1f  50%% %.1f  99%% %.1f  99.99%% %.1f  max %.1f\n",
+            latency_us[0],
+            sum / NUM_TRIALS,
+            latency_us[NUM_TRIALS / 2],
+            latency_us[NUM_TRIALS / 100 * 99],
+            latency_us[NUM_TRIALS / 10000 * 9999],
+            latency_us[NUM_TRIALS - 1]);
+
+    return 0;
+}
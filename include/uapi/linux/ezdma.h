@@ -0,0 +1,400 @@
+/*
+ * ezdma userspace interface.
+ *
+ * Copyright (C) 2015 Jeremy Trimble
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UAPI_LINUX_EZDMA_H
+#define _UAPI_LINUX_EZDMA_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define EZDMA_IOC_MAGIC     'z'
+
+/* Upper limit on the number of buffers in a channel's buffer pool. */
+#define EZDMA_POOL_MAX_BUFS (4096)
+
+/*
+ * Buffer pools:
+ *
+ * Each channel can own a pool of kernel-allocated DMA buffers.  Buffer N of
+ * the pool is mapped into userspace by calling mmap() on the channel's fd
+ * with an offset of (N * page size) and a length of at most the buffer size.
+ */
+struct ezdma_pool_req {
+    __u32   count;  /* number of buffers */
+    __u32   size;   /* size of each buffer, in bytes */
+};
+
+#define EZDMA_IOC_POOL_ALLOC    _IOW(EZDMA_IOC_MAGIC, 0x01, struct ezdma_pool_req)
+#define EZDMA_IOC_POOL_FREE     _IO(EZDMA_IOC_MAGIC, 0x02)
+
+/*
+ * Size-class pools:
+ *
+ * A pool can instead be made of up to EZDMA_POOL_MAX_CLASSES classes of
+ * buffers, in strictly ascending size.  Buffers are numbered class by class.
+ * Buffers smaller than a page are packed several to a page, 'stride' bytes
+ * apart; mmap()ing such a buffer maps its whole page, and the buffer starts
+ * at ((N - first) % (page size / stride)) * stride within it.
+ *
+ * When streaming RX from a multi-class pool, each descriptor posted to the
+ * engine chains one free buffer of every class, smallest first, so a packet
+ * fills a small buffer and only spills into the larger ones when it has to.
+ * Buffers a packet didn't reach are reposted without being reported.  This
+ * needs an engine which ends the descriptor at the packet boundary and
+ * reports the residue of each segment.
+ *
+ * With EZDMA_POOL_CONTIG, every buffer is one physically contiguous, coherent
+ * allocation (from CMA, or the DMA device's reserved-memory region), of any
+ * size, so each transfer is a single segment even on engines without
+ * scatter-gather.  Each buffer then starts its own mapping, at offset 0.
+ * Coherent memory is typically uncached on the CPU side, so it is slow for the
+ * CPU to read.
+ */
+#define EZDMA_POOL_MAX_CLASSES  (4)
+
+struct ezdma_pool_class {
+    __u32   count;  /* number of buffers */
+    __u32   size;   /* size of each buffer, in bytes */
+    __u32   first;  /* out: index of the class' first buffer */
+    __u32   stride; /* out: spacing of buffers packed into a page */
+};
+
+struct ezdma_pool_classes_req {
+    __u32                   num_classes;
+    __u32                   flags;      /* EZDMA_POOL_* */
+    struct ezdma_pool_class classes[EZDMA_POOL_MAX_CLASSES];
+};
+
+#define EZDMA_POOL_CONTIG   (1 << 0)
+
+#define EZDMA_IOC_POOL_ALLOC_CLASSES    _IOWR(EZDMA_IOC_MAGIC, 0x07, struct ezdma_pool_classes_req)
+
+/*
+ * Forwarding:
+ *
+ * Issued on an RX channel fd which has a buffer pool, with the fd of an open
+ * TX channel as argument.  Every RX completion is resubmitted unchanged on the
+ * TX channel, and the buffer is posted back to RX once the TX completes.  No
+ * data passes through userspace.  Pass -1 to unbind.
+ */
+#define EZDMA_IOC_FORWARD       _IOW(EZDMA_IOC_MAGIC, 0x03, __s32)
+
+/*
+ * Completion groups:
+ *
+ * EZDMA_IOC_GROUP_CREATE, issued on any ezdma fd, returns a new fd which
+ * aggregates the completions of every listed channel into a single ring.
+ * Each channel's pool must already be allocated, and a channel can belong to
+ * at most one group.  The group keeps the channels open until it is closed.
+ *
+ * read() on the group fd returns as many whole struct ezdma_completion
+ * records as fit (blocking for at least one unless O_NONBLOCK), and poll()
+ * reports it readable when records are waiting.  Writing records back to the
+ * group fd hands their buffers back to the driver to be posted again, so a
+ * consumer can process and recycle a whole batch with one read() and one
+ * write().
+ *
+ * The ring has room for a record of every pool buffer, so it only fills up if
+ * a buffer is written back before its record has been read.  Records that
+ * don't fit are lost, along with the buffers they'd have handed over, and the
+ * next one that fits has EZDMA_COMPL_LOST set.
+ */
+#define EZDMA_GROUP_MAX_CHANNELS    (16)
+
+struct ezdma_group_req {
+    __u32   count;
+    __s32   fds[EZDMA_GROUP_MAX_CHANNELS];
+};
+
+struct ezdma_completion {
+    __u32   chan;   /* index of the channel in ezdma_group_req.fds */
+    __u32   buf;    /* pool buffer index */
+    __u32   len;    /* bytes transferred */
+    __u32   flags;  /* EZDMA_COMPL_* */
+    __u32   seq;    /* per-channel packet number, see EZDMA_IOC_SET_OVERRUN */
+    __u32   crc;    /* CRC32C of the data, with EZDMA_COMPL_CRC, see EZDMA_IOC_SET_CRC */
+};
+
+#define EZDMA_COMPL_ERROR       (1 << 0)    /* the engine reported an error */
+#define EZDMA_COMPL_MORE        (1 << 1)    /* packet continues in the next record */
+#define EZDMA_COMPL_TIMEDOUT    (1 << 2)    /* missed its deadline and was cancelled */
+#define EZDMA_COMPL_OVERRUN     (1 << 3)    /* first packet since the consumer fell behind */
+#define EZDMA_COMPL_CRC         (1 << 4)    /* crc is valid */
+#define EZDMA_COMPL_TRIGGER     (1 << 5)    /* first packet after a capture's trigger */
+#define EZDMA_COMPL_LOST        (1 << 6)    /* records before this one didn't fit in the ring */
+/* bits 16-23: subchannel the RX filter steered the packet to, see EZDMA_IOC_SET_FILTER */
+
+#define EZDMA_IOC_GROUP_CREATE  _IOW(EZDMA_IOC_MAGIC, 0x04, struct ezdma_group_req)
+
+/*
+ * Streaming RX:  post every pool buffer to the engine and keep them posted.
+ * Completed buffers are reported through the channel's group, and go back to
+ * the engine when they're written back to the group fd.  The channel must be
+ * a member of a group.  read() returns EBUSY while streaming.
+ */
+#define EZDMA_IOC_STREAM_START  _IO(EZDMA_IOC_MAGIC, 0x05)
+#define EZDMA_IOC_STREAM_STOP   _IO(EZDMA_IOC_MAGIC, 0x06)
+
+/*
+ * Overruns:  every packet reported through a group gets the channel's next
+ * sequence number (all the records of a packet share it), counting from 0 at
+ * open.  A streaming RX consumer has fallen behind when it holds every pool
+ * buffer but those of the packet that just landed, leaving the engine with
+ * nowhere to put the next one.  That is counted in the channel's overruns
+ * sysfs attribute and handled according to its policy:
+ *
+ *  STALL       report the packet; the engine waits until buffers are
+ *              written back (what the source does meanwhile is up to it).
+ *  STOP        report the packet and stop the stream: buffers written back
+ *              are no longer posted until EZDMA_IOC_STREAM_STOP/START.
+ *  DROP        drop the packet that just landed and post its buffers again.
+ *  OVERWRITE   drop the channel's oldest packet that hasn't been read from
+ *              the group yet and post its buffers again.  Falls back to DROP
+ *              if there isn't one at the head of the group's ring.
+ *
+ * Dropped packets use up their sequence numbers, so the consumer sees exactly
+ * how many it lost.  The next packet reported is flagged with
+ * EZDMA_COMPL_OVERRUN.  The policy resets to STALL on every open.
+ */
+#define EZDMA_OVERRUN_STALL     (0)
+#define EZDMA_OVERRUN_STOP      (1)
+#define EZDMA_OVERRUN_DROP      (2)
+#define EZDMA_OVERRUN_OVERWRITE (3)
+
+#define EZDMA_IOC_SET_OVERRUN   _IOW(EZDMA_IOC_MAGIC, 0x10, __u32)
+
+/*
+ * Queued TX:  send len bytes of a pool buffer of a TX channel.  Returns as
+ * soon as the buffer is queued; its completion is reported through the
+ * channel's group, which it must be a member of.  High-priority buffers are
+ * issued ahead of any queued normal-priority ones, and normal-priority
+ * buffers are never allowed to fill the engine's whole queue (see the
+ * tx_queue_depth and tx_bulk_depth sysfs attributes of the channel).
+ *
+ * A buffer which hasn't completed timeout_ms after it was submitted is
+ * reported with EZDMA_COMPL_TIMEDOUT.  If it had already been issued, the
+ * engine is reset and the other issued buffers are issued again.
+ */
+struct ezdma_submit {
+    __u32   buf;        /* pool buffer index */
+    __u32   len;        /* bytes to send */
+    __u32   flags;      /* EZDMA_SUBMIT_* */
+    __u32   timeout_ms; /* 0: the fd's timeout, see EZDMA_IOC_SET_TIMEOUT */
+};
+
+#define EZDMA_SUBMIT_HIGH_PRIO  (1 << 0)
+
+#define EZDMA_IOC_SUBMIT        _IOW(EZDMA_IOC_MAGIC, 0x08, struct ezdma_submit)
+
+/*
+ * Rate limits:  token buckets applied to every read(), write() and
+ * EZDMA_IOC_SUBMIT on the fd.  A transfer waits until both buckets hold
+ * enough tokens (or fails with EAGAIN under O_NONBLOCK).  A transfer larger
+ * than the burst is let through once the bucket is full, and the debt is
+ * paid back before the next one.  max_outstanding_bytes caps the bytes
+ * queued with EZDMA_IOC_SUBMIT which haven't completed yet.  Zero disables a
+ * limit.  The limits are reset whenever the channel is opened.
+ */
+struct ezdma_limits {
+    __u64   bytes_per_sec;
+    __u32   packets_per_sec;
+    __u32   burst_packets;          /* 0: a tenth of a second's worth */
+    __u64   burst_bytes;            /* 0: a tenth of a second's worth */
+    __u64   max_outstanding_bytes;
+};
+
+/* Upper limit on bytes_per_sec, and so on burst_bytes (at most 1s worth). */
+#define EZDMA_LIMIT_MAX_RATE    (1ULL << 34)
+
+#define EZDMA_IOC_SET_LIMITS    _IOW(EZDMA_IOC_MAGIC, 0x09, struct ezdma_limits)
+#define EZDMA_IOC_GET_LIMITS    _IOR(EZDMA_IOC_MAGIC, 0x0a, struct ezdma_limits)
+
+/*
+ * Timeouts:  sets how long, in milliseconds, read() and write() on the fd wait
+ * for their transfer before cancelling it and failing with ETIMEDOUT.  It's
+ * also the deadline of buffers submitted without one of their own.  0, the
+ * default on every open, waits forever.
+ */
+#define EZDMA_IOC_SET_TIMEOUT   _IOW(EZDMA_IOC_MAGIC, 0x0b, __u32)
+
+/*
+ * NUMA placement:  pools, and the page lists of read() and write(), are
+ * allocated on the NUMA node of the device doing the DMA unless this picks
+ * another node.  Pass -1 to go back to the device's node.  Must be issued
+ * before the pool is allocated, and resets on every open.  The node in use
+ * is shown in the channel's numa_node sysfs attribute.
+ */
+#define EZDMA_IOC_SET_NUMA_NODE _IOW(EZDMA_IOC_MAGIC, 0x0c, __s32)
+
+/*
+ * Progressive RX:  EZDMA_IOC_SET_RX_CHUNK splits each read() on an RX channel
+ * into descriptors of the given size, rounded up to whole pages (0, the
+ * default on every open, reads into one descriptor).  As each descriptor
+ * completes, its part of the buffer is handed back to the CPU and the
+ * channel's status page is updated, so another thread can start on the data
+ * while the rest is still arriving.  Each chunk has to be ended by the engine
+ * on its own: on packet-based hardware, every chunk is a packet.
+ *
+ * The status page is mapped read-only with mmap() at an offset of
+ * (EZDMA_STATUS_PGOFF * page size).  seq is odd while the kernel is updating
+ * it; reread if seq was odd or changed while reading the other fields.
+ */
+#define EZDMA_STATUS_PGOFF      (EZDMA_POOL_MAX_BUFS)
+
+struct ezdma_rx_status {
+    __u32   seq;
+    __u32   reads;      /* read() calls started */
+    __u64   landed;     /* bytes of the current read() that have landed */
+};
+
+#define EZDMA_IOC_SET_RX_CHUNK  _IOW(EZDMA_IOC_MAGIC, 0x0d, __u32)
+
+/*
+ * Prepared transfers:  EZDMA_IOC_PREPARE sets up a transfer of the first len
+ * bytes of a pool buffer, and each EZDMA_IOC_TRIGGER then runs it and waits
+ * for it, like write() (TX) or read() (RX) of that buffer would.  If the
+ * engine can reuse descriptors, the descriptor is built once and only
+ * resubmitted by each trigger.  The buffer stays with userspace in between:
+ * fill it before triggering on TX, read it once the trigger returns on RX.
+ * One transfer per channel, replaced by the next EZDMA_IOC_PREPARE; len 0
+ * drops it.  The pool can't be freed while a transfer is prepared.
+ */
+struct ezdma_prepare {
+    __u32   buf;    /* pool buffer index */
+    __u32   len;    /* bytes to transfer, 0 to drop the prepared transfer */
+};
+
+#define EZDMA_IOC_PREPARE       _IOW(EZDMA_IOC_MAGIC, 0x0e, struct ezdma_prepare)
+#define EZDMA_IOC_TRIGGER       _IO(EZDMA_IOC_MAGIC, 0x0f)
+
+/*
+ * RX filter:  rules run on every packet a streaming RX channel receives,
+ * before it is reported to the group.  Each rule takes the 4 bytes at offset
+ * within the packet, as they lie in memory (so in host byte order), ANDs them
+ * with mask and compares them with value.  The first rule that matches gives
+ * the verdict, and default_verdict applies if none does or the packet is too
+ * short for a rule:
+ *
+ *  DELIVER     report the packet as usual.
+ *  DROP        put its buffers straight back on the engine, unreported.  No
+ *              sequence number is used up, and nobody is woken.
+ *  STEER       report it with the rule's subchan in its records' flags, see
+ *              EZDMA_COMPL_SUBCHAN(), so consumers can tell classes of
+ *              traffic apart without looking at it.
+ *  TRIGGER     trigger a capture with it, see EZDMA_IOC_CAPTURE_ARM.  Like
+ *              DELIVER if no capture is armed.
+ *
+ * Rules only see the first buffer of a packet, and packets the engine
+ * reported an error for are always delivered.  While a filter is set,
+ * packets are counted per verdict in the filter_delivered, filter_dropped
+ * and filter_steered sysfs attributes.  num_rules 0 turns the filter off, as
+ * does every open.
+ */
+#define EZDMA_FILTER_MAX_RULES  (8)
+
+#define EZDMA_FILTER_DELIVER    (0)
+#define EZDMA_FILTER_DROP       (1)
+#define EZDMA_FILTER_STEER      (2)
+#define EZDMA_FILTER_TRIGGER    (3)
+
+struct ezdma_filter_rule {
+    __u32   offset;     /* of the 4 bytes to test, in bytes */
+    __u32   mask;
+    __u32   value;
+    __u32   verdict;    /* EZDMA_FILTER_* */
+    __u32   subchan;    /* for EZDMA_FILTER_STEER, 1 to 255 */
+};
+
+struct ezdma_filter {
+    __u32                       num_rules;
+    __u32                       default_verdict;    /* EZDMA_FILTER_DELIVER or _DROP */
+    struct ezdma_filter_rule    rules[EZDMA_FILTER_MAX_RULES];
+};
+
+#define EZDMA_COMPL_SUBCHAN_SHIFT   (16)
+#define EZDMA_COMPL_SUBCHAN(flags)  (((flags) >> EZDMA_COMPL_SUBCHAN_SHIFT) & 0xff)
+
+#define EZDMA_IOC_SET_FILTER    _IOW(EZDMA_IOC_MAGIC, 0x11, struct ezdma_filter)
+
+/*
+ * Integrity checking:  with EZDMA_IOC_SET_CRC set to 1, the driver computes
+ * the CRC32C (Castagnoli, as used by iSCSI and ext4) of the data of every
+ * pool buffer it reports through the group, and returns it in the record's
+ * crc with EZDMA_COMPL_CRC set.  On a TX channel that is the data as it was
+ * when EZDMA_IOC_SUBMIT was issued.  On a streaming RX channel it runs over
+ * the packet so far, so a packet's last record (the one without
+ * EZDMA_COMPL_MORE) has the CRC of the whole packet.  Nothing is computed for
+ * transfers that fail.  Turned off (0) on every open.
+ */
+#define EZDMA_IOC_SET_CRC       _IOW(EZDMA_IOC_MAGIC, 0x12, __u32)
+
+/*
+ * Draining:  EZDMA_IOC_DRAIN waits until every buffer submitted on a TX
+ * channel with EZDMA_IOC_SUBMIT has completed (or timed out), for at most the
+ * given number of milliseconds (0: the fd's timeout, see
+ * EZDMA_IOC_SET_TIMEOUT), and fails with ETIMEDOUT if they haven't by then.
+ * It doesn't stop anything being submitted meanwhile.
+ *
+ * Queued TX stops when the channel's group is closed (the group holds the
+ * channel open, so that is the last close).  With EZDMA_CLOSE_ABORT, the
+ * default on every open, whatever hasn't completed by then is discarded.
+ * With EZDMA_CLOSE_DRAIN, it's first given timeout_ms (0: forever) to drain,
+ * unless the closing process is being killed.
+ */
+struct ezdma_close {
+    __u32   policy;     /* EZDMA_CLOSE_* */
+    __u32   timeout_ms;
+};
+
+#define EZDMA_CLOSE_ABORT       (0)
+#define EZDMA_CLOSE_DRAIN       (1)
+
+#define EZDMA_IOC_SET_CLOSE     _IOW(EZDMA_IOC_MAGIC, 0x13, struct ezdma_close)
+#define EZDMA_IOC_DRAIN         _IOW(EZDMA_IOC_MAGIC, 0x14, __u32)
+
+/*
+ * Triggered capture:  once EZDMA_IOC_CAPTURE_ARM is issued on a streaming RX
+ * channel, its packets are no longer reported as they land.  The driver keeps
+ * the most recent ones instead, at least pre_bytes worth, and puts the buffers
+ * of older ones straight back on the engine.  A trigger -- EZDMA_IOC_CAPTURE_
+ * TRIGGER, which takes effect from the next packet, or a packet matching an
+ * EZDMA_FILTER_TRIGGER rule -- freezes that history.  Packets keep being
+ * collected until post_bytes more have landed.  The whole capture is then
+ * reported through the group, oldest first, with EZDMA_COMPL_TRIGGER on the
+ * records of the first packet after the trigger, and the channel re-arms
+ * itself for the next one.  The engine keeps streaming into whatever buffers
+ * are left throughout.
+ *
+ * If the engine runs out of buffers, history is let go before a trigger, and
+ * the capture is cut short after one.  So pre_bytes + post_bytes should fit
+ * comfortably in the pool, next to any capture the consumer still holds.
+ * Sequence numbers show where packets went missing in between.  Arming again
+ * abandons a capture in progress, and arming with both sizes 0 goes back to
+ * reporting every packet, as does every open.  Captures reported are counted
+ * in the captures sysfs attribute.
+ */
+struct ezdma_capture {
+    __u64   pre_bytes;      /* history to keep from before the trigger */
+    __u64   post_bytes;     /* to collect after it */
+};
+
+#define EZDMA_IOC_CAPTURE_ARM       _IOW(EZDMA_IOC_MAGIC, 0x15, struct ezdma_capture)
+#define EZDMA_IOC_CAPTURE_TRIGGER   _IO(EZDMA_IOC_MAGIC, 0x16)
+
+#endif /* _UAPI_LINUX_EZDMA_H */